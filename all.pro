@@ -0,0 +1,17 @@
+#-------------------------------------------------
+#
+# Application, daemon and benchmarks in one build:
+#   qmake all.pro && make
+#
+#-------------------------------------------------
+
+TEMPLATE = subdirs
+
+SUBDIRS += \
+    app \
+    daemon \
+    bench
+
+app.file = questroomcontrol.pro
+daemon.file = daemon/qrcdaemon.pro
+bench.file = bench/qrcbench.pro
@@ -0,0 +1,411 @@
+/******************************************************************************
+ *
+ * Quest Room Control
+ *
+ * Micro-benchmarks of protocol, helpers and models
+ *
+ * (c) Roman A. Bulygin 2016
+ *
+ ******************************************************************************/
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QStringList>
+#include <QTextStream>
+
+#include "qrc_animator.hpp"
+#include "qrc_gamma.hpp"
+#include "qrc_ledencoder.hpp"
+#include "qrc_ledpack.hpp"
+#include "qrc_ledmodel.hpp"
+#include "qrc_protocol.hpp"
+#include "qrc_scan.hpp"
+#include "qrc_smartledmodel.hpp"
+#include "qrc_state.hpp"
+
+using namespace qrc;
+
+enum {
+    DEFAULT_MIN_TIME = 200, // ms на один замер
+    STREAM_PACKETS = 64,    // ответов в потоке для разбора
+    FRAGMENT_SIZE = 7,      // байт за одно чтение во фрагментированном потоке
+};
+
+// Сюда складываются результаты, чтобы компилятор не выкинул измеряемый код
+static volatile unsigned int sink;
+
+struct Result
+{
+    QString name;
+    qint64 iterations;
+    double nsPerOp;
+    double bytesPerOp; // 0 - пропускная способность не считается
+};
+
+class Bench
+{
+    QString mFilter;
+    qint64 mMinTime; // ns
+    QList<Result> mResults;
+public:
+    Bench(const QString& filter, int minTime)
+        : mFilter(filter)
+        , mMinTime(qint64(minTime) * 1000000)
+    {}
+
+    // Прогнать f() столько раз, чтобы замер занял не меньше mMinTime
+    template <class F>
+    void run(const QString& name, int bytes, F f)
+    {
+        if (!mFilter.isEmpty() && !name.contains(mFilter))
+            return;
+
+        f(); // прогрев
+        qint64 iterations = 1;
+        qint64 elapsed = 0;
+        forever
+        {
+            QElapsedTimer timer;
+            timer.start();
+            for (qint64 i = 0; i < iterations; ++i)
+                f();
+            elapsed = timer.nsecsElapsed();
+            if (elapsed >= mMinTime)
+                break;
+            iterations *= 2;
+        }
+
+        Result result;
+        result.name = name;
+        result.iterations = iterations;
+        result.nsPerOp = double(elapsed) / iterations;
+        result.bytesPerOp = bytes;
+        mResults.append(result);
+
+        QTextStream err(stderr);
+        err << QString("%1 %2 ns/op").arg(name, -32).arg(result.nsPerOp, 12, 'f', 1);
+        if (bytes > 0)
+            err << QString(" %1 MB/s").arg(bytes * 1000.0 / result.nsPerOp, 10, 'f', 1);
+        err << "\n";
+    }
+
+    // Машиночитаемые результаты, чтобы сравнивать прогоны скриптом
+    void writeJson(QTextStream& out) const
+    {
+        out << "{\n";
+        out << "  \"qt\": \"" << QT_VERSION_STR << "\",\n";
+        out << "  \"scan\": \"" << scanImplementation() << "\",\n";
+        out << "  \"led_pack\": \"" << ledPackImplementation() << "\",\n";
+        out << "  \"results\": [\n";
+        for (int i = 0; i < mResults.size(); ++i)
+        {
+            const Result& r = mResults[i];
+            out << "    {\"name\": \"" << r.name << "\""
+                << ", \"iterations\": " << r.iterations
+                << ", \"ns_per_op\": " << QString::number(r.nsPerOp, 'f', 2);
+            if (r.bytesPerOp > 0)
+                out << ", \"mb_per_s\": " << QString::number(r.bytesPerOp * 1000.0 / r.nsPerOp, 'f', 2);
+            out << "}" << ((i + 1 < mResults.size()) ? "," : "") << "\n";
+        }
+        out << "  ]\n";
+        out << "}\n";
+    }
+};
+
+// Предсказуемые "случайные" данные, чтобы прогоны были сравнимы
+static unsigned int nextRandom(unsigned int& seed)
+{
+    seed = seed * 1103515245u + 12345u;
+    return seed >> 16;
+}
+
+static QByteArray makePayload(int size, unsigned int seed)
+{
+    QByteArray data;
+    for (int i = 0; i < size; ++i)
+        data.append(char(nextRandom(seed)));
+    return data;
+}
+
+// Поток ответов на CMD_GET_STATE. noisy - мусор между пакетами и испорченные пакеты
+static QByteArray makeStream(bool noisy)
+{
+    unsigned int seed = 7;
+    QByteArray stream;
+    for (int i = 0; i < STREAM_PACKETS; ++i)
+    {
+        QByteArray packet = request(1 + i % 14, CMD_GET_STATE, makePayload(replySize(CMD_GET_STATE), seed + i));
+        if (noisy)
+        {
+            for (int n = nextRandom(seed) % 8; n > 0; --n)
+                stream.append(char(nextRandom(seed) & 0x7F)); // без признака начала
+            if (nextRandom(seed) % 10 == 0)
+            {
+                int pos = 1 + nextRandom(seed) % (packet.size() - 1);
+                packet[pos] = char(packet[pos] ^ 0x01);
+            }
+        }
+        stream.append(packet);
+    }
+    return stream;
+}
+
+static void benchEncode(Bench& bench)
+{
+    static unsigned char buffer[1024];
+    QByteArray empty;
+    QByteArray leds = makePayload(QRC_XLED_COUNT * 12 / 8, 1);
+
+    bench.run("encode/request/hello", packetSize(0), [&]() {
+        sink += request(1, CMD_HELLO, empty).size();
+    });
+    bench.run("encode/request/smart_leds", packetSize(leds.size()), [&]() {
+        sink += request(1, CMD_SET_SMART_LEDS, leds).size();
+    });
+    bench.run("encode/buffer/smart_leds", packetSize(leds.size()), [&]() {
+        sink += encodeRequest(1, CMD_SET_SMART_LEDS,
+                              reinterpret_cast<const unsigned char*>(leds.constData()), leds.size(), buffer);
+    });
+}
+
+static void benchParse(Bench& bench, const QString& name, const QByteArray& stream)
+{
+    bench.run("parse/legacy/" + name, stream.size(), [&]() {
+        QByteArray buffer = stream;
+        unsigned char address;
+        unsigned char command;
+        QByteArray data;
+        while (parse(buffer, address, command, data) != PARSE_NONE)
+            sink += command;
+    });
+    bench.run("parse/stream/" + name, stream.size(), [&]() {
+        static StreamParser parser;
+        StreamParser::Packet packet;
+        parser.reset();
+        for (int pos = 0; pos < stream.size(); )
+        {
+            pos += parser.feed(stream.constData() + pos, stream.size() - pos);
+            while (parser.next(packet))
+                sink += packet.command;
+        }
+    });
+}
+
+static void benchParseFragmented(Bench& bench, const QByteArray& stream)
+{
+    bench.run("parse/legacy/fragmented", stream.size(), [&]() {
+        QByteArray buffer;
+        unsigned char address;
+        unsigned char command;
+        QByteArray data;
+        for (int pos = 0; pos < stream.size(); pos += FRAGMENT_SIZE)
+        {
+            buffer.append(stream.constData() + pos, qMin(int(FRAGMENT_SIZE), stream.size() - pos));
+            while (parse(buffer, address, command, data) != PARSE_NONE)
+                sink += command;
+        }
+    });
+    bench.run("parse/stream/fragmented", stream.size(), [&]() {
+        static StreamParser parser;
+        StreamParser::Packet packet;
+        parser.reset();
+        for (int pos = 0; pos < stream.size(); pos += FRAGMENT_SIZE)
+        {
+            parser.feed(stream.constData() + pos, qMin(int(FRAGMENT_SIZE), stream.size() - pos));
+            while (parser.next(packet))
+                sink += packet.command;
+        }
+    });
+}
+
+static void benchScan(Bench& bench)
+{
+    // Длинный кусок без единого признака начала - худший случай для поиска
+    QByteArray noise(4096, char(0x55));
+    bench.run("scan/find_tag/4k", noise.size(), [&]() {
+        sink += findTag(reinterpret_cast<const unsigned char*>(noise.constData()), noise.size(), 0xF0, 0x80);
+    });
+    bench.run("scan/sum_bytes/4k", noise.size(), [&]() {
+        sink += sumBytes(reinterpret_cast<const unsigned char*>(noise.constData()), noise.size());
+    });
+}
+
+static void benchState(Bench& bench)
+{
+    QByteArray state = makePayload(replySize(CMD_GET_STATE), 3);
+    bench.run("state/decode/lists", state.size(), [&]() {
+        sink += getKeys(state.mid(0, 3)).size();
+        sink += getSliders(state.mid(3, 8)).size();
+        sink += getEncoders(state.mid(11, 8)).size();
+        sink += getSensors(state.mid(19, 2)).size();
+        sink += getKeys(state.mid(21, 3)).size();
+    });
+    bench.run("state/decode/snapshot", state.size(), [&]() {
+        StateSnapshot snapshot;
+        decodeState(reinterpret_cast<const unsigned char*>(state.constData()), state.size(), 1, 0, snapshot);
+        sink += snapshot.keys + snapshot.encoders[3];
+    });
+}
+
+static void benchLeds(Bench& bench)
+{
+    int value = 0;
+    bench.run("leds/led_helper/set_all", 0, [&]() {
+        LedHelper leds;
+        for (int i = 0; i < leds.size(); ++i)
+            leds.set(i, (i + value) & 1);
+        sink += leds.data().size();
+        ++value;
+    });
+    bench.run("leds/led_helper/chase", 0, [&]() {
+        static LedHelper leds;
+        static LedHelper sent;
+        if (leds.count() == 0)
+            leds.setRange(0, 8, true);
+        leds.rotate(1);
+        sink += leds.diffCount(sent);
+        sent = leds;
+        sink += leds.data().size();
+    });
+    bench.run("leds/xled_helper/set_all", 0, [&]() {
+        XLedHelper leds;
+        for (int i = 0; i < leds.size(); ++i)
+            leds.set(i, (i * 37 + value) & 0xFFF);
+        sink += leds.data().size();
+        ++value;
+    });
+    bench.run("leds/xled_helper/get_all", 0, [&]() {
+        static XLedHelper leds;
+        for (int i = 0; i < leds.size(); ++i)
+            sink += leds.get(i);
+    });
+    unsigned short channels[QRC_XLED_COUNT];
+    bench.run("leds/xled_helper/set_range_all", 0, [&]() {
+        static XLedHelper leds;
+        for (int i = 0; i < QRC_XLED_COUNT; ++i)
+            channels[i] = (unsigned short)((i * 37 + value) & 0xFFF);
+        leds.setAll(channels);
+        sink += leds.data().size();
+        ++value;
+    });
+    bench.run("leds/xled_helper/get_range_all", 0, [&]() {
+        static XLedHelper leds;
+        leds.getAll(channels);
+        sink += channels[value % QRC_XLED_COUNT];
+        ++value;
+    });
+
+    LedAnimation animation;
+    for (int group = 0; group < QRC_XLED_GROUPS; ++group)
+        for (int key = 0; key < 8; ++key)
+            animation.setKey(group, key * 125, (group + key) * 97, key * 500, 4095 - key * 500);
+    animation.setLoop(true);
+    bench.run("leds/animation/render_32_groups", 0, [&]() {
+        static XLedHelper leds;
+        animation.render(value * 40, leds);
+        sink += leds.get(0);
+        ++value;
+    });
+
+    LedGamma gamma(2.2, 200);
+    quint16 linear[QRC_XLED_COUNT];
+    quint16 corrected[QRC_XLED_COUNT];
+    quint16 residual[QRC_XLED_COUNT] = {};
+    for (int i = 0; i < QRC_XLED_COUNT; ++i)
+        linear[i] = quint16(i * 43);
+    bench.run("leds/gamma/frame", 0, [&]() {
+        gamma.apply(linear, corrected, QRC_XLED_COUNT);
+        sink += corrected[value % QRC_XLED_COUNT];
+        ++value;
+    });
+    bench.run("leds/gamma/frame_dithered", 0, [&]() {
+        gamma.apply(linear, corrected, QRC_XLED_COUNT, residual);
+        sink += corrected[value % QRC_XLED_COUNT];
+        ++value;
+    });
+
+    XLedHelper frame;
+    bench.run("leds/encoder/one_led_changed", 0, [&]() {
+        static SmartLedEncoder encoder;
+        frame.set(value % frame.size(), value & 0xFFF);
+        for (const LedCommand& command : encoder.encode(frame.data()))
+            sink += command.data.size();
+        ++value;
+    });
+}
+
+static void benchModels(Bench& bench)
+{
+    QrcLedModel ledModel;
+    bench.run("model/leds/set_all", 0, [&]() {
+        for (int row = 0; row < ledModel.rowCount(); ++row)
+            for (int column = 0; column < ledModel.columnCount(); ++column)
+                ledModel.setData(ledModel.index(row, column), (row + column) & 1, Qt::CheckStateRole);
+    });
+    bench.run("model/leds/read_all", 0, [&]() {
+        for (int row = 0; row < ledModel.rowCount(); ++row)
+            for (int column = 0; column < ledModel.columnCount(); ++column)
+                sink += ledModel.data(ledModel.index(row, column), Qt::CheckStateRole).toInt();
+    });
+
+    QrcSmartLedModel smartModel;
+    bench.run("model/smart_leds/set_all", 0, [&]() {
+        for (int row = 0; row < smartModel.rowCount(); ++row)
+            for (int column = 0; column < smartModel.columnCount(); ++column)
+                smartModel.setData(smartModel.index(row, column), (row * 16 + column) & 0xFFF, Qt::EditRole);
+    });
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QString filter;
+    QString jsonFile;
+    int minTime = DEFAULT_MIN_TIME;
+    QStringList args = app.arguments();
+    for (int i = 1; i < args.size(); ++i)
+    {
+        if ((args[i] == "--filter") && (i + 1 < args.size()))
+            filter = args[++i];
+        else if ((args[i] == "--min-time") && (i + 1 < args.size()))
+            minTime = qMax(1, args[++i].toInt());
+        else if ((args[i] == "--json") && (i + 1 < args.size()))
+            jsonFile = args[++i];
+        else
+        {
+            QTextStream(stderr) << "usage: qrcbench [--filter text] [--min-time ms] [--json file]\n";
+            return 1;
+        }
+    }
+
+    Bench bench(filter, minTime);
+    benchEncode(bench);
+    benchParse(bench, "clean", makeStream(false));
+    benchParse(bench, "noisy", makeStream(true));
+    benchParseFragmented(bench, makeStream(false));
+    benchScan(bench);
+    benchState(bench);
+    benchLeds(bench);
+    benchModels(bench);
+
+    // JSON - в файл или в stdout, человекочитаемая таблица уже ушла в stderr
+    if (jsonFile.isEmpty())
+    {
+        QTextStream out(stdout);
+        bench.writeJson(out);
+    }
+    else
+    {
+        QFile file(jsonFile);
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        {
+            QTextStream(stderr) << "can not write " << jsonFile << "\n";
+            return 1;
+        }
+        QTextStream out(&file);
+        bench.writeJson(out);
+    }
+    return 0;
+}
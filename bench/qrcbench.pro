@@ -0,0 +1,17 @@
+#-------------------------------------------------
+#
+# Micro-benchmarks of protocol, helpers and models.
+# Run: qrcbench [--filter text] [--min-time ms] [--json file]
+#
+#-------------------------------------------------
+
+include(../src/qrc_core.pri)
+include(../src/qrc_models.pri)
+
+TARGET = qrcbench
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+SOURCES += \
+    qrc_bench.cpp
@@ -0,0 +1,71 @@
+/******************************************************************************
+ *
+ * Quest Room Control
+ *
+ * Headless daemon entry point
+ *
+ * (c) Roman A. Bulygin 2016
+ *
+ ******************************************************************************/
+
+#include <QCoreApplication>
+#include <QSocketNotifier>
+#include <QStringList>
+#include <QTextCodec>
+
+#include "qrc_daemon.hpp"
+
+#ifdef Q_OS_UNIX
+#include <csignal>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// SIGINT/SIGTERM -> байт в сокет -> QCoreApplication::quit() уже в цикле событий
+static int signalSockets[2];
+
+static void quitSignal(int)
+{
+    char byte = 1;
+    if (::write(signalSockets[0], &byte, sizeof(byte)) < 0)
+        return;
+}
+
+static void installQuitSignals(QCoreApplication& app)
+{
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, signalSockets) != 0)
+        return;
+    QSocketNotifier* notifier = new QSocketNotifier(signalSockets[1], QSocketNotifier::Read, &app);
+    QObject::connect(notifier, SIGNAL(activated(int)), &app, SLOT(quit()));
+
+    struct sigaction action;
+    action.sa_handler = quitSignal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGINT, &action, 0);
+    sigaction(SIGTERM, &action, 0);
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+#if QT_VERSION < QT_VERSION_CHECK(5,0,0)
+    QTextCodec::setCodecForTr (QTextCodec::codecForName ("UTF-8"));
+    QTextCodec::setCodecForCStrings (QTextCodec::codecForName ("UTF-8"));
+#endif
+    QTextCodec::setCodecForLocale (QTextCodec::codecForName ("UTF-8"));
+
+    QCoreApplication app(argc, argv);
+#ifdef Q_OS_UNIX
+    installQuitSignals(app);
+#endif
+
+    QStringList args = app.arguments();
+    QString config = (args.size() > 1) ? args[1] : QString("qrcdaemon.ini");
+
+    qrc::Daemon daemon;
+    QObject::connect(&app, SIGNAL(aboutToQuit()), &daemon, SLOT(stop()));
+    if (!daemon.start(config))
+        return 1;
+
+    return app.exec();
+}
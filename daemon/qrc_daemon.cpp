@@ -0,0 +1,204 @@
+/******************************************************************************
+ *
+ * Quest Room Control
+ *
+ * Headless daemon: drives the hardware from a config file
+ *
+ * (c) Roman A. Bulygin 2016
+ *
+ ******************************************************************************/
+
+#include "qrc_daemon.hpp"
+
+#include <QDir>
+#include <QFileInfo>
+#include <QSettings>
+#include <QStringList>
+
+namespace qrc {
+
+// Список узлов "1, 2, 0x13" в адреса, неверные пропускаются
+static QList<int> parseAddresses(const QStringList& items)
+{
+    QList<int> addresses;
+    for (const QString& item : items)
+    {
+        bool ok = false;
+        int address = item.trimmed().toInt(&ok, 0);
+        if (ok && (0 <= address) && (address <= 0xFF))
+            addresses.append(address);
+    }
+    return addresses;
+}
+
+Daemon::Daemon(QObject *parent)
+    : QObject(parent)
+{
+    baudRateTimer.setSingleShot(true);
+    connect(&baudRateTimer, SIGNAL(timeout()), SLOT(ready()));
+
+    connect(&hardware, SIGNAL(error(QString)),              SLOT(hardwareError(QString)));
+    connect(&hardware, SIGNAL(baudRateChanged(int, int)),   SLOT(hardwareBaudRate(int, int)));
+    connect(&hardware, SIGNAL(discovered(QList<int>)),      SLOT(hardwareDiscovered(QList<int>)));
+}
+
+bool Daemon::start(const QString& configFile)
+{
+    if (!QFileInfo(configFile).isReadable())
+    {
+        qWarning("%s", qPrintable(QString(tr("Нет файла настроек %1")).arg(configFile)));
+        return false;
+    }
+
+    QSettings settings(configFile, QSettings::IniFormat);
+    settings.beginGroup("connection");
+    QStringList ports = settings.value("ports").toStringList();
+    baudrate = settings.value("baudrate", int(BAUDRATE_9600)).toInt();
+    scanOnStart = settings.value("scan", true).toBool();
+    settings.endGroup();
+
+    settings.beginGroup("polling");
+    pollInterval = settings.value("interval", 0).toInt();
+    pollBudget = settings.value("budget", 0).toInt();
+    pollAddresses = parseAddresses(settings.value("addresses").toStringList());
+    settings.endGroup();
+
+    settings.beginGroup("inputs");
+    hardware.setInputThresholds(settings.value("slider", 2).toInt(),
+                                settings.value("encoder", 1).toInt(),
+                                settings.value("sensor", 1).toInt());
+    logInputs = settings.value("log", true).toBool();
+    settings.endGroup();
+
+    // Путь к правилам - относительно файла настроек
+    QString rules = settings.value("rules/file").toString();
+    if (!rules.isEmpty())
+    {
+        rules = QFileInfo(configFile).absoluteDir().absoluteFilePath(rules);
+        if (!hardware.loadRules(rules))
+            return false;
+        qDebug("%s", qPrintable(QString(tr("Правила: %1, условий %2")).arg(rules).arg(hardware.rules()->size())));
+        connect(&hardware, SIGNAL(ruleFired(int, int)), SLOT(logRule(int, int)));
+    }
+
+    if (logInputs)
+    {
+        connect(&hardware, SIGNAL(keyChanged(int, int, bool)),          SLOT(logKey(int, int, bool)));
+        connect(&hardware, SIGNAL(stikyKeyChanged(int, int, bool)),     SLOT(logStikyKey(int, int, bool)));
+        connect(&hardware, SIGNAL(sliderChanged(int, int, int)),        SLOT(logSlider(int, int, int)));
+        connect(&hardware, SIGNAL(encoderMoved(int, int, int, int)),    SLOT(logEncoder(int, int, int, int)));
+        connect(&hardware, SIGNAL(sensorChanged(int, int, int)),        SLOT(logSensor(int, int, int)));
+    }
+
+    for (const QString& port : ports)
+    {
+        QString name = port.trimmed();
+        if (name.isEmpty())
+            continue;
+        int bus = hardware.addBus(hardware.addEndpoint(name));
+        if (bus >= 0)
+            qDebug("%s", qPrintable(QString(tr("Шина %1: %2")).arg(bus).arg(name)));
+    }
+    if (hardware.busCount() == 0)
+    {
+        qWarning("%s", qPrintable(QString(tr("Ни одна шина не подключена"))));
+        return false;
+    }
+
+    if (baudrate == BAUDRATE_9600)
+    {
+        ready();
+        return true;
+    }
+
+    // Скорость переводится для всей шины сразу, дальше ждём baudRateChanged от каждой шины
+    pendingBuses = hardware.busCount();
+    for (int bus = 0; bus < hardware.busCount(); ++bus)
+        hardware.requestSetBaudRate(nodeAddress(bus, 0), baudrate);
+    baudRateTimer.start(BAUDRATE_TIMEOUT);
+    return true;
+}
+
+void Daemon::stop()
+{
+    baudRateTimer.stop();
+    pendingBuses = 0;
+    hardware.stop();
+}
+
+void Daemon::ready()
+{
+    baudRateTimer.stop();
+    if (pendingBuses > 0)
+        qWarning("%s", qPrintable(QString(tr("Не все шины перешли на скорость %1")).arg(qrc::baudRate(baudrate))));
+    pendingBuses = 0;
+
+    for (int bus = 0; bus < hardware.busCount(); ++bus)
+        hardware.setPollBudget(bus, pollBudget);
+
+    if (pollAddresses.isEmpty() && scanOnStart)
+        hardware.scan();
+    else
+        startPolling(pollAddresses);
+}
+
+void Daemon::startPolling(const QList<int>& addresses)
+{
+    if (pollInterval <= 0)
+        return;
+    for (int address : addresses)
+        hardware.setPolling(address, pollInterval);
+}
+
+void Daemon::hardwareError(const QString& message)
+{
+    qWarning("%s", qPrintable(message));
+}
+
+void Daemon::hardwareBaudRate(int bus, int baudrate)
+{
+    qDebug("%s", qPrintable(QString(tr("Шина %1: %2 бод")).arg(bus).arg(qrc::baudRate(baudrate))));
+    if ((pendingBuses > 0) && (--pendingBuses == 0))
+        ready();
+}
+
+void Daemon::hardwareDiscovered(QList<int> addresses)
+{
+    QStringList names;
+    for (int address : addresses)
+        names.append(QString("0x%1").arg(address, 2, 16, QChar('0')));
+    qDebug("%s", qPrintable(QString(tr("Найдены платы: %1")).arg(names.join(", "))));
+    startPolling(addresses);
+}
+
+void Daemon::logRule(int address, int line)
+{
+    qDebug("0x%02x rule at line %d", address, line);
+}
+
+void Daemon::logKey(int address, int key, bool down)
+{
+    qDebug("0x%02x key %d %s", address, key, down ? "down" : "up");
+}
+
+void Daemon::logStikyKey(int address, int key, bool stiky)
+{
+    qDebug("0x%02x stiky %d %s", address, key, stiky ? "set" : "clear");
+}
+
+void Daemon::logSlider(int address, int slider, int value)
+{
+    qDebug("0x%02x slider %d = %d", address, slider, value);
+}
+
+void Daemon::logEncoder(int address, int encoder, int value, int delta)
+{
+    qDebug("0x%02x encoder %d = %d (%+d)", address, encoder, value, delta);
+}
+
+void Daemon::logSensor(int address, int sensor, int value)
+{
+    qDebug("0x%02x sensor %d = %d", address, sensor, value);
+}
+
+} // namespace qrc
@@ -0,0 +1,73 @@
+/******************************************************************************
+ *
+ * Quest Room Control
+ *
+ * Headless daemon: drives the hardware from a config file
+ *
+ * (c) Roman A. Bulygin 2016
+ *
+ ******************************************************************************/
+
+#pragma once
+
+#ifndef _QRC_DAEMON_HPP_
+#define _QRC_DAEMON_HPP_
+
+#include <QList>
+#include <QObject>
+#include <QTimer>
+
+#include "qrc_connection.hpp"
+
+namespace qrc {
+
+// Работа без окон: порты, скорость, поиск плат и опрос берутся из INI-файла
+// (пример - daemon/qrcdaemon.ini), ошибки и события входов пишутся в журнал.
+class Daemon : public QObject
+{
+    Q_OBJECT
+
+    enum {
+        BAUDRATE_TIMEOUT = 2000, // мс ждать перехода шин на новую скорость
+    };
+
+    Connection hardware;
+    QTimer baudRateTimer;
+
+    int baudrate {BAUDRATE_9600};
+    bool scanOnStart {true};
+    int pollInterval {0};
+    int pollBudget {0};
+    QList<int> pollAddresses;
+    bool logInputs {true};
+
+    int pendingBuses {0}; // шины, ещё не перешедшие на baudrate
+
+    void startPolling(const QList<int>& addresses);
+public:
+    explicit Daemon(QObject *parent = 0);
+
+    // Прочитать настройки и подключить шины. false - не подключено ни одной шины
+    bool start(const QString& configFile);
+    Connection& connection() { return hardware; }
+
+public slots:
+    void stop();
+
+private slots:
+    void ready(); // шины на нужной скорости: искать платы или сразу опрашивать
+    void hardwareError(const QString& message);
+    void hardwareBaudRate(int bus, int baudrate);
+    void hardwareDiscovered(QList<int> addresses);
+
+    void logRule(int address, int line);
+    void logKey(int address, int key, bool down);
+    void logStikyKey(int address, int key, bool stiky);
+    void logSlider(int address, int slider, int value);
+    void logEncoder(int address, int encoder, int value, int delta);
+    void logSensor(int address, int sensor, int value);
+};
+
+} // namespace qrc
+
+#endif // _QRC_DAEMON_HPP_
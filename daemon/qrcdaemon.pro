@@ -0,0 +1,25 @@
+#-------------------------------------------------
+#
+# Headless daemon for production rooms: QCoreApplication only,
+# no widgets and no models linked.
+# Run: qrcdaemon [config.ini]
+#
+#-------------------------------------------------
+
+include(../src/qrc_core.pri)
+
+TARGET = qrcdaemon
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+SOURCES += \
+    main.cpp \
+    qrc_daemon.cpp
+
+HEADERS += \
+    qrc_daemon.hpp
+
+DISTFILES += \
+    qrcdaemon.ini \
+    quest.rules
@@ -4,7 +4,8 @@
 #
 #-------------------------------------------------
 
-QT       += core gui
+include(src/qrc_core.pri)
+include(src/qrc_models.pri)
 
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
@@ -14,31 +15,12 @@ TEMPLATE = app
 
 SOURCES += \
     src/main.cpp \
-    src/qrc_connection.cpp \
-    src/qrc_device.cpp \
-    src/qrc_protocol.cpp \
-    src/mainwindow.cpp \
-    src/qrc_ledmodel.cpp \
-    src/qrc_smartledmodel.cpp
+    src/mainwindow.cpp
 
 HEADERS  += \
-    src/qrc_connection.hpp \
-    src/qrc_device.hpp \
-    src/qrc_protocol.hpp \
-    src/mainwindow.hpp \
-    src/qrc_ledmodel.hpp \
-    src/qrc_smartledmodel.hpp
+    src/mainwindow.hpp
 
 FORMS    += \
     src/mainwindow.ui
 
-equals(QT_MAJOR_VERSION, 4) {
-    CONFIG += serialport # QT 4
-}
-greaterThan(QT_MAJOR_VERSION, 4) {
-    QT += serialport #QT5
-}
-
-QMAKE_CXXFLAGS += -std=c++11
-
 QMAKE_LFLAGS_RELEASE += -static -static-libgcc
@@ -1,8 +1,12 @@
 #include "mainwindow.hpp"
 #include "ui_mainwindow.h"
 
+#include <QApplication>
+#include <QClipboard>
+#include <QRegExp>
 #include <QSerialPort>
 #include <QSerialPortInfo>
+#include <QShortcut>
 
 #include "qrc_protocol.hpp"
 
@@ -10,6 +14,30 @@ enum {
     REPEAT_INTERVAL = 500, // msec
 };
 
+// Числа из буфера обмена - в ячейки светодиодов подряд по строкам, начиная с текущей.
+// Ячейки без флага flag (номера групп) пропускаются. Возвращает число вставленных.
+static int pasteValues(QTableView* view, int role, Qt::ItemFlag flag)
+{
+    QAbstractItemModel* model = view->model();
+    QStringList values = QApplication::clipboard()->text().split(QRegExp("[\\s,;]+"), QString::SkipEmptyParts);
+    QModelIndex start = view->currentIndex().isValid() ? view->currentIndex() : model->index(0, 0);
+
+    int pasted = 0;
+    for (int row = start.row(); (row < model->rowCount()) && (pasted < values.size()); ++row)
+    {
+        for (int column = (row == start.row()) ? start.column() : 0;
+             (column < model->columnCount()) && (pasted < values.size()); ++column)
+        {
+            QModelIndex index = model->index(row, column);
+            if (!(model->flags(index) & flag))
+                continue;
+            const QString& text = values[pasted++];
+            model->setData(index, (role == Qt::CheckStateRole) ? QVariant(text.toInt() != 0) : QVariant(text), role);
+        }
+    }
+    return pasted;
+}
+
 MainWindow::MainWindow(QWidget *parent)
     : QMainWindow(parent)
     , ui(new Ui::MainWindow)
@@ -32,6 +60,12 @@ MainWindow::MainWindow(QWidget *parent)
     connect(&smartLedModel,SIGNAL(ledsChanged(QByteArray)), SLOT(smartLedsChanged(QByteArray)));
     connect(&smartLedModel,SIGNAL(ledChanged(int,int,int,int)), SLOT(smartLedChanged(int,int,int,int)));
 
+    // Вставка столбца значений - один пакет правок и одна отправка на плату
+    QShortcut* paste = new QShortcut(QKeySequence::Paste, ui->tableViewLeds, 0, 0, Qt::WidgetWithChildrenShortcut);
+    connect(paste, SIGNAL(activated()), SLOT(pasteLeds()));
+    paste = new QShortcut(QKeySequence::Paste, ui->tableViewSmartLeds, 0, 0, Qt::WidgetWithChildrenShortcut);
+    connect(paste, SIGNAL(activated()), SLOT(pasteSmartLeds()));
+
     connect(ui->checkBoxRelay0, SIGNAL(clicked()), SLOT(relayClicked()));
     connect(ui->checkBoxRelay1, SIGNAL(clicked()), SLOT(relayClicked()));
     connect(ui->checkBoxRelay2, SIGNAL(clicked()), SLOT(relayClicked()));
@@ -45,21 +79,24 @@ MainWindow::MainWindow(QWidget *parent)
     connect(&hardware, SIGNAL(error(QString)),                SLOT(hardwareError(QString)));
     connect(&hardware, SIGNAL(parseError(int, QByteArray)),   SLOT(hardwareParseError(int, QByteArray)));
     connect(&hardware, SIGNAL(replySilent(int, int)),         SLOT(hardwareReplySilent(int, int)));
-    connect(&hardware, SIGNAL(replyTicketSuccess()),          SLOT(hardwareTicketSuccess()));
-    connect(&hardware, SIGNAL(replyTicketUnknown()),          SLOT(hardwareTicketUnknown()));
+    connect(&hardware, SIGNAL(replyTicketSuccess(int)),       SLOT(hardwareTicketSuccess(int)));
+    connect(&hardware, SIGNAL(replyTicketUnknown(int)),       SLOT(hardwareTicketUnknown(int)));
     connect(&hardware, SIGNAL(timeout(int, int, QByteArray)), SLOT(hardwareTimeout(int, int, QByteArray)));
-
-    connect(&hardware, SIGNAL(replyHello()),                SLOT(hardwareHello()));
-    connect(&hardware, SIGNAL(replyKeys(QList<bool>)),      SLOT(hardwareKeys(QList<bool>)));
-    connect(&hardware, SIGNAL(replySliders(QList<int>)),    SLOT(hardwareSliders(QList<int>)));
-    connect(&hardware, SIGNAL(replyEncoders(QList<int>)),   SLOT(hardwareEncoders(QList<int>)));
-    connect(&hardware, SIGNAL(replySensors(QList<int>)),    SLOT(hardwareSensors(QList<int>)));
-    connect(&hardware, SIGNAL(replyStikyKeys(QList<bool>)), SLOT(hardwareStikyKeys(QList<bool>)));
-    connect(&hardware, SIGNAL(replyState(QList<bool>,QList<int>,QList<int>,QList<int>,QList<bool>))
-            , SLOT(hardwareState(QList<bool>,QList<int>,QList<int>,QList<int>,QList<bool>)));
-    repeatTimer.setInterval(REPEAT_INTERVAL) ;
-    repeatTimer.setSingleShot(false);
-    connect(&repeatTimer, SIGNAL(timeout()), this, SLOT(on_pushButtonState_clicked()));
+    connect(&hardware, SIGNAL(baudRateChanged(int, int)),     SLOT(hardwareBaudRate(int, int)));
+    connect(&hardware, SIGNAL(discovered(QList<int>)),        SLOT(hardwareDiscovered(QList<int>)));
+
+    connect(&hardware, SIGNAL(replyHello(int)),                  SLOT(hardwareHello(int)));
+    connect(&hardware, SIGNAL(replyKeys(int, QList<bool>)),      SLOT(hardwareKeys(int, QList<bool>)));
+    connect(&hardware, SIGNAL(replySliders(int, QList<int>)),    SLOT(hardwareSliders(int, QList<int>)));
+    connect(&hardware, SIGNAL(replyEncoders(int, QList<int>)),   SLOT(hardwareEncoders(int, QList<int>)));
+    connect(&hardware, SIGNAL(replySensors(int, QList<int>)),    SLOT(hardwareSensors(int, QList<int>)));
+    connect(&hardware, SIGNAL(replyStikyKeys(int, QList<bool>)), SLOT(hardwareStikyKeys(int, QList<bool>)));
+    connect(&hardware, SIGNAL(replyState(qrc::StateSnapshot)), SLOT(hardwareState(qrc::StateSnapshot)));
+    connect(&hardware, SIGNAL(keyChanged(int, int, bool)),          SLOT(hardwareKeyChanged(int, int, bool)));
+    connect(&hardware, SIGNAL(stikyKeyChanged(int, int, bool)),     SLOT(hardwareStikyKeyChanged(int, int, bool)));
+    connect(&hardware, SIGNAL(sliderChanged(int, int, int)),        SLOT(hardwareSliderChanged(int, int, int)));
+    connect(&hardware, SIGNAL(encoderMoved(int, int, int, int)),    SLOT(hardwareEncoderMoved(int, int, int, int)));
+    connect(&hardware, SIGNAL(sensorChanged(int, int, int)),        SLOT(hardwareSensorChanged(int, int, int)));
 }
 
 MainWindow::~MainWindow()
@@ -76,6 +113,8 @@ void MainWindow::hardwareStarted()
 
 void MainWindow::hardwareStopped()
 {
+    pollAddress = -1;
+    shownAddress = -1;
     rescanAvailablePorts();
     ui->checkBoxPortStart->setEnabled(true);
     ui->checkBoxPortStart->setChecked(false);
@@ -98,13 +137,15 @@ void MainWindow::hardwareReplySilent(int address, int command)
     ui->labelErrorResult->setText(QString(tr("Завершено без ответа 0x%1")).arg(command, 2, 16, QLatin1Char('0')));
 }
 
-void MainWindow::hardwareTicketSuccess()
+void MainWindow::hardwareTicketSuccess(int address)
 {
+    Q_UNUSED(address)
     ui->labelErrorResult->setText(QString(tr("Успех")));
 }
 
-void MainWindow::hardwareTicketUnknown()
+void MainWindow::hardwareTicketUnknown(int address)
 {
+    Q_UNUSED(address)
     ui->labelErrorResult->setText(QString(tr("Неизвестная команда")));
 }
 
@@ -116,6 +157,33 @@ void MainWindow::hardwareTimeout(int address, int command, const QByteArray& dat
                                   .arg(command, 2, 16, QLatin1Char('0')));
 }
 
+void MainWindow::hardwareBaudRate(int bus, int baudrate)
+{
+    Q_UNUSED(bus)
+    // Без сигнала, иначе сами себе закажем ещё одну смену скорости
+    ui->comboBoxBaudRate->blockSignals(true);
+    ui->comboBoxBaudRate->setCurrentIndex(baudrate);
+    ui->comboBoxBaudRate->blockSignals(false);
+    ui->labelErrorResult->setText(QString(tr("Скорость %1 бод")).arg(qrc::baudRate(baudrate)));
+}
+
+void MainWindow::hardwareDiscovered(QList<int> addresses)
+{
+    if (addresses.isEmpty())
+    {
+        ui->labelErrorResult->setText(QString(tr("Платы не найдены")));
+        return;
+    }
+    QStringList names;
+    for (int address : addresses)
+    {
+        names.append(qrc::nodeBus(address) == 0
+                     ? QString::number(address)
+                     : QString("%1:%2").arg(qrc::nodeBus(address)).arg(qrc::nodeBoard(address)));
+    }
+    ui->labelErrorResult->setText(QString(tr("Найдены платы: %1")).arg(names.join(", ")));
+}
+
 static inline void boolListToForm(const QList<bool>& list, QListWidget* widget)
 {
     if(!widget)
@@ -138,54 +206,119 @@ static inline void intListToForm(const QList<int>& list, QListWidget* widget)
     widget->insertItems(0, strings);
 }
 
-void MainWindow::hardwareHello()
+static inline void bitsToForm(quint32 bits, int count, QListWidget* widget)
+{
+    QList<bool> list;
+    for(int i = 0; i < count; ++i)
+        list.append((bits >> i) & 1);
+    boolListToForm(list, widget);
+}
+
+template <class T>
+static inline void valuesToForm(const T* values, int count, QListWidget* widget)
 {
+    QList<int> list;
+    for(int i = 0; i < count; ++i)
+        list.append(values[i]);
+    intListToForm(list, widget);
+}
+
+void MainWindow::hardwareHello(int address)
+{
+    Q_UNUSED(address)
     ui->labelErrorResult->setText(QString(tr("Успех")));
 }
 
-void MainWindow::hardwareKeys(QList<bool> keys)
+void MainWindow::hardwareKeys(int address, QList<bool> keys)
 {
+    Q_UNUSED(address)
+    shownAddress = -1; // списки теперь от разных ответов
     ui->labelErrorResult->setText(QString(tr("Успех")));
     boolListToForm(keys, ui->listKeys);
 }
 
-void MainWindow::hardwareSliders(QList<int> sliders)
+void MainWindow::hardwareSliders(int address, QList<int> sliders)
 {
+    Q_UNUSED(address)
+    shownAddress = -1; // списки теперь от разных ответов
     ui->labelErrorResult->setText(QString(tr("Успех")));
     intListToForm(sliders, ui->listSliders);
 }
 
-void MainWindow::hardwareEncoders(QList<int> encoders)
+void MainWindow::hardwareEncoders(int address, QList<int> encoders)
 {
+    Q_UNUSED(address)
+    shownAddress = -1; // списки теперь от разных ответов
     ui->labelErrorResult->setText(QString(tr("Успех")));
     intListToForm(encoders, ui->listEncoders);
 }
 
-void MainWindow::hardwareSensors(QList<int> sensors)
+void MainWindow::hardwareSensors(int address, QList<int> sensors)
 {
+    Q_UNUSED(address)
+    shownAddress = -1; // списки теперь от разных ответов
     ui->labelErrorResult->setText(QString(tr("Успех")));
     intListToForm(sensors, ui->listSensors);
 
 }
 
-void MainWindow::hardwareStikyKeys(QList<bool> stiky)
+void MainWindow::hardwareStikyKeys(int address, QList<bool> stiky)
 {
+    Q_UNUSED(address)
+    shownAddress = -1; // списки теперь от разных ответов
     ui->labelErrorResult->setText(QString(tr("Успех")));
     boolListToForm(stiky, ui->listStikyKeys);
 }
 
-void MainWindow::hardwareState(QList<bool> keys,
-                               QList<int> sliders,
-                               QList<int> encoders,
-                               QList<int> sensors,
-                               QList<bool> stiky)
+void MainWindow::hardwareState(const qrc::StateSnapshot& state)
 {
+    // Списки одной и той же платы дальше обновляются по событиям изменений
+    if (state.address == shownAddress)
+        return;
+    shownAddress = state.address;
     ui->labelErrorResult->setText(QString(tr("Успех")));
-    boolListToForm(keys, ui->listKeys);
-    intListToForm(sliders, ui->listSliders);
-    intListToForm(encoders, ui->listEncoders);
-    intListToForm(sensors, ui->listSensors);
-    boolListToForm(stiky, ui->listStikyKeys);
+    bitsToForm(state.keys, qrc::QRC_KEY_COUNT, ui->listKeys);
+    valuesToForm(state.sliders, qrc::QRC_SLIDER_COUNT, ui->listSliders);
+    valuesToForm(state.encoders, qrc::QRC_ENCODER_COUNT, ui->listEncoders);
+    valuesToForm(state.sensors, qrc::QRC_SENSOR_COUNT, ui->listSensors);
+    bitsToForm(state.stiky, qrc::QRC_STIKY_COUNT, ui->listStikyKeys);
+}
+
+static inline void setFormItem(QListWidget* widget, int index, const QString& value)
+{
+    if (widget && (index < widget->count()))
+        widget->item(index)->setText(QString("%1: %2").arg(index+1).arg(value));
+}
+
+void MainWindow::hardwareKeyChanged(int address, int key, bool down)
+{
+    if (address == shownAddress)
+        setFormItem(ui->listKeys, key, down ? "ВКЛ" : "выкл");
+}
+
+void MainWindow::hardwareStikyKeyChanged(int address, int key, bool stiky)
+{
+    if (address == shownAddress)
+        setFormItem(ui->listStikyKeys, key, stiky ? "ВКЛ" : "выкл");
+}
+
+void MainWindow::hardwareSliderChanged(int address, int slider, int value)
+{
+    if (address == shownAddress)
+        setFormItem(ui->listSliders, slider, QString::number(value));
+}
+
+void MainWindow::hardwareEncoderMoved(int address, int encoder, int value, int delta)
+{
+    Q_UNUSED(delta)
+    if (address == shownAddress)
+        setFormItem(ui->listEncoders, encoder, QString::number(value));
+}
+
+void MainWindow::hardwareSensorChanged(int address, int sensor, int value)
+{
+    if (address == shownAddress)
+        setFormItem(ui->listSensors, sensor, QString::number(value));
 }
 
 void MainWindow::ledsChanged(const QByteArray& leds)
@@ -205,6 +338,20 @@ void MainWindow::smartLedChanged(int group, int r, int g, int b)
         hardware.requestSmartLed(ui->comboBoxAddress->currentIndex(), group, r, g, b);
 }
 
+void MainWindow::pasteLeds()
+{
+    ledModel.beginBatch();
+    pasteValues(ui->tableViewLeds, Qt::CheckStateRole, Qt::ItemIsUserCheckable);
+    ledModel.endBatch();
+}
+
+void MainWindow::pasteSmartLeds()
+{
+    smartLedModel.beginBatch();
+    pasteValues(ui->tableViewSmartLeds, Qt::EditRole, Qt::ItemIsEditable);
+    smartLedModel.endBatch();
+}
+
 void MainWindow::relayClicked()
 {
     unsigned char relays =
@@ -227,6 +374,13 @@ void MainWindow::enableConnectControls(bool isConnected)
 {
     ui->labelPort->setEnabled(!isConnected);
     ui->comboBoxPort->setEnabled(!isConnected);
+    ui->comboBoxBaudRate->setEnabled(isConnected);
+    if (!isConnected) // после подключения платы работают на 9600
+    {
+        ui->comboBoxBaudRate->blockSignals(true);
+        ui->comboBoxBaudRate->setCurrentIndex(qrc::BAUDRATE_9600);
+        ui->comboBoxBaudRate->blockSignals(false);
+    }
     if(isConnected) // только в случае успешного подключения, чтобы не затереть ошибку
         ui->labelErrorResult->setText(tr("Порт подключён"));
 }
@@ -244,19 +398,18 @@ void MainWindow::on_checkBoxPortStart_clicked(bool checked)
     if (checked)
     {
         hardware.start(ui->comboBoxPort->currentIndex(), ui->comboBoxBaudRate->currentIndex());
-        if (ui->checkBoxTimer->isChecked())
-            repeatTimer.start();
+        updatePolling();
     }
     else
     {
-        repeatTimer.stop();
         hardware.stop();
     }
 }
 
 void MainWindow::on_comboBoxBaudRate_currentIndexChanged(int index)
 {
-    hardware.requestSetBaudRate(index);
+    if (ui->checkBoxPortStart->isChecked())
+        hardware.requestSetBaudRate(qrc::nodeAddress(qrc::nodeBus(ui->comboBoxAddress->currentIndex()), 0), index);
 }
 
 void MainWindow::on_pushButtonHello_clicked()
@@ -265,6 +418,12 @@ void MainWindow::on_pushButtonHello_clicked()
     hardware.requestHello(ui->comboBoxAddress->currentIndex());
 }
 
+void MainWindow::on_pushButtonScan_clicked()
+{
+    ui->labelErrorResult->setText(tr("Поиск плат..."));
+    hardware.scan();
+}
+
 void MainWindow::on_pushButtonKeys_clicked()
 {
     hardware.requestGetKeys(ui->comboBoxAddress->currentIndex());
@@ -297,8 +456,27 @@ void MainWindow::on_pushButtonState_clicked()
 
 void MainWindow::on_checkBoxTimer_clicked(bool checked)
 {
-    if (checked && ui->checkBoxPortStart->isChecked())
-        repeatTimer.start();
-    else
-        repeatTimer.stop();
+    Q_UNUSED(checked)
+    updatePolling();
+}
+
+void MainWindow::on_comboBoxAddress_currentIndexChanged(int index)
+{
+    Q_UNUSED(index)
+    updatePolling();
+}
+
+void MainWindow::updatePolling()
+{
+    int address = (ui->checkBoxTimer->isChecked() && ui->checkBoxPortStart->isChecked())
+            ? ui->comboBoxAddress->currentIndex()
+            : -1;
+    if (address == pollAddress)
+        return;
+    // Опрос идёт в потоке порта, здесь только выбираем, кого опрашивать
+    if (pollAddress >= 0)
+        hardware.setPolling(pollAddress, 0);
+    if (address >= 0)
+        hardware.setPolling(address, REPEAT_INTERVAL);
+    pollAddress = address;
 }
@@ -2,7 +2,6 @@
 #define MAINWINDOW_HPP
 
 #include <QMainWindow>
-#include <QTimer>
 
 #include "qrc_connection.hpp"
 #include "qrc_ledmodel.hpp"
@@ -23,12 +22,14 @@ public:
 private:
     Ui::MainWindow *ui;
     qrc::Connection hardware;
-    QTimer repeatTimer;
+    int pollAddress {-1}; // какую плату опрашивает hardware
+    int shownAddress {-1}; // чьё состояние в списках входов, -1 - списки надо перерисовать
     QrcLedModel ledModel;
     QrcSmartLedModel smartLedModel;
 
     void rescanAvailablePorts();
     void enableConnectControls(bool isConnected);
+    void updatePolling();
 
 private slots:
     void hardwareStarted();
@@ -36,34 +37,41 @@ private slots:
     void hardwareError(const QString& message);
     void hardwareParseError(int error, const QByteArray& data);
     void hardwareReplySilent(int address, int command);
-    void hardwareTicketSuccess();
-    void hardwareTicketUnknown();
+    void hardwareTicketSuccess(int address);
+    void hardwareTicketUnknown(int address);
     void hardwareTimeout(int address, int command, const QByteArray& data);
+    void hardwareBaudRate(int bus, int baudrate);
+    void hardwareDiscovered(QList<int> addresses);
 
     // Ответы на запрос состояния платы
-    void hardwareHello();
-    void hardwareKeys(QList<bool> keys);
-    void hardwareSliders(QList<int> sliders);
-    void hardwareEncoders(QList<int> encoders);
-    void hardwareSensors(QList<int> sensors);
-    void hardwareStikyKeys(QList<bool> stiky);
-    void hardwareState(QList<bool> keys,
-                       QList<int> sliders,
-                       QList<int> encoders,
-                       QList<int> sensors,
-                       QList<bool> stiky);
+    void hardwareHello(int address);
+    void hardwareKeys(int address, QList<bool> keys);
+    void hardwareSliders(int address, QList<int> sliders);
+    void hardwareEncoders(int address, QList<int> encoders);
+    void hardwareSensors(int address, QList<int> sensors);
+    void hardwareStikyKeys(int address, QList<bool> stiky);
+    void hardwareState(const qrc::StateSnapshot& state);
+    void hardwareKeyChanged(int address, int key, bool down);
+    void hardwareStikyKeyChanged(int address, int key, bool stiky);
+    void hardwareSliderChanged(int address, int slider, int value);
+    void hardwareEncoderMoved(int address, int encoder, int value, int delta);
+    void hardwareSensorChanged(int address, int sensor, int value);
     // реакция на диоды
     void ledsChanged(const QByteArray& leds);
     void smartLedsChanged(const QByteArray& leds);
     void smartLedChanged(int group, int r, int g, int b);
+    void pasteLeds();
+    void pasteSmartLeds();
     void relayClicked();
 
 private slots:
     void on_comboBoxPort_currentIndexChanged(int index);
     void on_checkBoxPortStart_clicked(bool checked);
     void on_comboBoxBaudRate_currentIndexChanged(int index);
+    void on_comboBoxAddress_currentIndexChanged(int index);
 
     void on_pushButtonHello_clicked();
+    void on_pushButtonScan_clicked();
     void on_pushButtonKeys_clicked();
     void on_pushButtonSliders_clicked();
     void on_pushButtonEncoders_clicked();
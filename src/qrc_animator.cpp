@@ -0,0 +1,283 @@
+/******************************************************************************
+ *
+ * Quest Room Control
+ *
+ * Keyframe animation of smart LEDs at a fixed frame rate
+ *
+ * (c) Roman A. Bulygin 2016
+ *
+ ******************************************************************************/
+
+#include "qrc_animator.hpp"
+
+#include <algorithm>
+
+#include <string.h>
+
+#include "qrc_connection.hpp"
+#include "qrc_timing.hpp"
+
+namespace qrc {
+
+enum {
+    FRAME_BYTES = (QRC_XLED_COUNT * 12 + 7) / 8, // данные CMD_SET_SMART_LEDS
+};
+
+static inline bool keyBefore(const LedKeyframe& key, int time)
+{
+    return key.time < time;
+}
+
+void LedTimeline::setKey(int time, int r, int g, int b)
+{
+    LedKeyframe key;
+    key.time = qMax(0, time);
+    key.r = qBound(0, r, 0x0FFF);
+    key.g = qBound(0, g, 0x0FFF);
+    key.b = qBound(0, b, 0x0FFF);
+
+    auto it = std::lower_bound(mKeys.begin(), mKeys.end(), key.time, keyBefore);
+    if ((it != mKeys.end()) && (it->time == key.time))
+        *it = key;
+    else
+        mKeys.insert(it, key);
+}
+
+void LedTimeline::clear()
+{
+    mKeys.clear();
+}
+
+void LedTimeline::sample(int time, int& r, int& g, int& b) const
+{
+    if (mKeys.isEmpty())
+    {
+        r = g = b = 0;
+        return;
+    }
+    // Первый кадр позже time
+    auto next = std::upper_bound(mKeys.begin(), mKeys.end(), time,
+                                 [](int t, const LedKeyframe& key) { return t < key.time; });
+    if (next == mKeys.begin())
+    {
+        r = next->r; g = next->g; b = next->b;
+        return;
+    }
+    const LedKeyframe& a = *(next - 1);
+    if (next == mKeys.end())
+    {
+        r = a.r; g = a.g; b = a.b;
+        return;
+    }
+    const LedKeyframe& z = *next;
+    int span = z.time - a.time; // > 0: времена кадров не повторяются
+    int t = time - a.time;
+    // 12 бит на длинный отрезок в мс в int уже не помещаются
+    r = a.r + int(qint64(z.r - a.r) * t / span);
+    g = a.g + int(qint64(z.g - a.g) * t / span);
+    b = a.b + int(qint64(z.b - a.b) * t / span);
+}
+
+void LedAnimation::setKey(int group, int time, int r, int g, int b)
+{
+    if ((0 <= group) && (group < QRC_XLED_GROUPS))
+        mGroups[group].setKey(time, r, g, b);
+}
+
+int LedAnimation::duration() const
+{
+    int duration = 0;
+    for (const LedTimeline& timeline : mGroups)
+        duration = qMax(duration, timeline.duration());
+    return duration;
+}
+
+bool LedAnimation::render(qint64 time, XLedHelper& frame) const
+{
+    quint16 channels[QRC_XLED_COUNT];
+    frame.getRange(0, channels, QRC_XLED_COUNT);
+    bool running = render(time, channels);
+    frame.setRange(0, channels, QRC_XLED_COUNT);
+    return running;
+}
+
+bool LedAnimation::render(qint64 time, quint16* channels) const
+{
+    int length = duration();
+    bool running = true;
+    if (mLoop && (length > 0))
+        time %= length;
+    else if (time >= length)
+    {
+        time = length;
+        running = false;
+    }
+
+    for (int group = 0; group < QRC_XLED_GROUPS; ++group)
+    {
+        const LedTimeline& timeline = mGroups[group];
+        if (timeline.isEmpty())
+            continue;
+        int r, g, b;
+        timeline.sample(int(time), r, g, b);
+        channels[group * 3 + LED_RED] = quint16(r);
+        channels[group * 3 + LED_GREEN] = quint16(g);
+        channels[group * 3 + LED_BLUE] = quint16(b);
+    }
+    return running;
+}
+
+Animator::Animator(QObject *parent)
+    : QObject(parent)
+    , mTimer(this)
+{
+    mTimer.setSingleShot(true);
+#if QT_VERSION >= QT_VERSION_CHECK(5,0,0)
+    mTimer.setTimerType(Qt::PreciseTimer);
+#endif
+    connect(&mTimer, SIGNAL(timeout()), this, SLOT(tick()));
+    mClock.start();
+}
+
+void Animator::setConnection(Connection* connection)
+{
+    if (mConnection != 0)
+        disconnect(mConnection, 0, this, 0);
+    mConnection = connection;
+    if (mConnection != 0)
+        connect(mConnection, SIGNAL(dropped(int, int, QByteArray)), this, SLOT(requestDropped(int, int, QByteArray)));
+}
+
+void Animator::setFrameRate(int fps)
+{
+    mFrameRate = qBound(1, fps, int(QRC_MAX_FRAME_RATE));
+}
+
+int Animator::busFrameRate(int baudrate, int boards, int share)
+{
+    // Худший случай - полный кадр и квитанция на каждую плату
+    int wire = wireTime(packetSize(FRAME_BYTES) + packetSize(0), baudrate) * qMax(1, boards);
+    return qMax(1, 10 * qBound(1, share, 100) / qMax(1, wire));
+}
+
+int Animator::fitToBus(int baudrate, int boards, int share)
+{
+    setFrameRate(qMin(mFrameRate, busFrameRate(baudrate, boards, share)));
+    return mFrameRate;
+}
+
+void Animator::setGamma(double gamma)
+{
+    mGamma.setGamma(gamma);
+}
+
+void Animator::setBrightness(int brightness)
+{
+    mGamma.setBrightness(brightness);
+}
+
+void Animator::setDithering(bool dithering)
+{
+    mDithering = dithering;
+}
+
+void Animator::play(int address, const LedAnimation& animation)
+{
+    bool fresh = !mTracks.contains(address);
+    Track& track = mTracks[address];
+    if (fresh)
+    {
+        memset(track.channels, 0, sizeof(track.channels));
+        memset(track.residual, 0, sizeof(track.residual));
+    }
+    track.animation = animation;
+    track.sent.clear(); // первый кадр уходит всегда
+
+    if (!mTimer.isActive())
+    {
+        mNextFrame = mClock.elapsed();
+        mTimer.start(0);
+    }
+    // Новая анимация встаёт на общую сетку кадров
+    track.start = mNextFrame;
+}
+
+void Animator::stop(int address)
+{
+    mTracks.remove(address);
+    if (mTracks.isEmpty())
+        mTimer.stop();
+}
+
+void Animator::stopAll()
+{
+    mTracks.clear();
+    mTimer.stop();
+}
+
+void Animator::tick()
+{
+    int interval = frameInterval();
+    qint64 now = mClock.elapsed();
+    if (now >= mNextFrame + interval)
+    {
+        // Таймер опоздал больше чем на кадр: пропущенные кадры не нужны никому
+        qint64 missed = (now - mNextFrame) / interval;
+        mDropped += int(missed);
+        mNextFrame += missed * interval;
+    }
+
+    QList<int> done;
+    for (auto it = mTracks.begin(); it != mTracks.end(); ++it)
+    {
+        Track& track = it.value();
+        bool running = track.animation.render(mNextFrame - track.start, track.channels);
+        quint16 corrected[QRC_XLED_COUNT];
+        mGamma.apply(track.channels, corrected, QRC_XLED_COUNT, mDithering ? track.residual : 0);
+        track.frame.setAll(corrected);
+        if (track.frame.data() != track.sent)
+        {
+            track.sent = track.frame.data();
+            emit frame(it.key(), track.sent);
+            // Кадр, не ушедший за время кадра, уже заменён следующим - незачем его слать.
+            // Срок только у своих кадров: прочие записи светодиодов шины ждут как обычно.
+            // Последнему кадру замены не будет - он уходит без срока.
+            if (mConnection != 0)
+                mConnection->requestSetSmartLeds(it.key(), track.sent, running ? interval : 0);
+        }
+        if (!running)
+            done.append(it.key());
+    }
+    for (int address : done)
+    {
+        mTracks.remove(address);
+        emit finished(address);
+    }
+
+    if (mTracks.isEmpty())
+        return;
+    mNextFrame += interval;
+    mTimer.start(int(qMax(qint64(0), mNextFrame - mClock.elapsed())));
+}
+
+void Animator::requestDropped(int address, int command, const QByteArray& data)
+{
+    Q_UNUSED(data)
+    // Кадр шина могла разбить на частичные записи, выброшена любая из них -
+    // на плате не отправленный кадр, и следующий тик отправит его заново
+    switch (command)
+    {
+    case CMD_SET_SMART_LEDS:
+    case SET_SPECIFIC_SMART_LEDS_8:
+    case SET_SPECIFIC_SMART_LEDS_4:
+    case SET_SPECIFIC_SMART_LED:
+        break;
+    default:
+        return;
+    }
+    auto it = mTracks.find(address);
+    if (it != mTracks.end())
+        it.value().sent.clear();
+}
+
+} // namespace qrc
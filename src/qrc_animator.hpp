@@ -0,0 +1,150 @@
+/******************************************************************************
+ *
+ * Quest Room Control
+ *
+ * Keyframe animation of smart LEDs at a fixed frame rate
+ *
+ * (c) Roman A. Bulygin 2016
+ *
+ ******************************************************************************/
+
+#pragma once
+
+#ifndef _QRC_ANIMATOR_HPP_
+#define _QRC_ANIMATOR_HPP_
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QMap>
+#include <QObject>
+#include <QTimer>
+#include <QVector>
+
+#include "qrc_batch.hpp"
+#include "qrc_gamma.hpp"
+#include "qrc_protocol.hpp"
+
+namespace qrc {
+
+class Connection;
+
+enum {
+    QRC_XLED_GROUPS = QRC_XLED_COUNT / 3, // RGB-групп умных светодиодов на плате
+};
+
+struct LedKeyframe
+{
+    int time; // мс от начала анимации
+    int r;    // яркости каналов, 12 бит
+    int g;
+    int b;
+};
+
+// Ключевые кадры одной RGB-группы. Между кадрами - линейно, до первого кадра
+// держится первый, после последнего - последний.
+class LedTimeline
+{
+    QVector<LedKeyframe> mKeys; // по возрастанию time
+public:
+    // Кадр на то же время заменяется
+    void setKey(int time, int r, int g, int b);
+    void clear();
+    bool isEmpty() const { return mKeys.isEmpty(); }
+    int duration() const { return mKeys.isEmpty() ? 0 : mKeys.last().time; }
+
+    void sample(int time, int& r, int& g, int& b) const;
+};
+
+// Анимация платы: по линии времени на каждую из 32 групп.
+// Группы без кадров при отрисовке не трогаются.
+class LedAnimation
+{
+    LedTimeline mGroups[QRC_XLED_GROUPS];
+    bool mLoop {false};
+public:
+    void setKey(int group, int time, int r, int g, int b);
+    LedTimeline& group(int index) { return mGroups[index]; }
+    const LedTimeline& group(int index) const { return mGroups[index]; }
+
+    void setLoop(bool loop) { mLoop = loop; }
+    bool loop() const { return mLoop; }
+    int duration() const; // самый поздний ключевой кадр, мс
+
+    // Кадр на момент time мс от начала. false - анимация без повтора уже закончилась
+    // (в frame при этом последний кадр).
+    bool render(qint64 time, XLedHelper& frame) const;
+    // То же в массив QRC_XLED_COUNT каналов по порядку R, G, B групп
+    bool render(qint64 time, quint16* channels) const;
+};
+
+// Проигрывание анимаций на нескольких платах с постоянной частотой кадров.
+// Кадры стоят на сетке времени от запуска: если таймер опоздал, пропущенные
+// кадры выбрасываются, а не догоняются, так что анимация не отстаёт под нагрузкой.
+// Кадр, не изменившийся с прошлого отправленного, не отправляется.
+// Анимации задаются в воспринимаемой яркости, перед отправкой - коррекция LedGamma.
+class Animator : public QObject
+{
+    Q_OBJECT
+
+    struct Track
+    {
+        LedAnimation animation;
+        quint16 channels[QRC_XLED_COUNT]; // кадр анимации до коррекции
+        quint16 residual[QRC_XLED_COUNT]; // дробные части дизеринга этой платы
+        XLedHelper frame;
+        QByteArray sent; // последний отправленный кадр
+        qint64 start;    // момент запуска по mClock, мс
+    };
+
+    QMap<int, Track> mTracks; // по адресам узлов
+    QTimer mTimer;
+    QElapsedTimer mClock;
+    Connection* mConnection {0};
+    LedGamma mGamma {1.0};
+    bool mDithering {false};
+    int mFrameRate {QRC_DEFAULT_FRAME_RATE};
+    qint64 mNextFrame {0}; // срок следующего кадра по mClock, мс
+    int mDropped {0};
+public:
+    explicit Animator(QObject *parent = 0);
+
+    // Кадры уходят в connection->requestSetSmartLeds со сроком в один кадр: не ушедший
+    // на линию за время кадра выбрасывается очередью шины, и тогда следующий тик
+    // отправляет кадр снова, даже не изменившийся. Последний кадр анимации без
+    // повтора - без срока. 0 - только сигналом frame.
+    void setConnection(Connection* connection);
+
+    void setFrameRate(int fps);
+    int frameRate() const { return mFrameRate; }
+    int frameInterval() const { return 1000 / mFrameRate; }
+    // Сколько полных кадров в секунду выдержит шина baudrate с boards платами,
+    // если кадрам отдать share процентов линии
+    static int busFrameRate(int baudrate, int boards, int share = 75);
+    // Ограничить частоту кадров бюджетом шины, возвращает получившуюся частоту
+    int fitToBus(int baudrate, int boards, int share = 75);
+
+    // Коррекция яркости всех кадров, по умолчанию - без коррекции (gamma 1.0)
+    void setGamma(double gamma);
+    void setBrightness(int brightness); // 0 - LedGamma::MAX_BRIGHTNESS
+    // Дизеринг во времени: имеет смысл при частоте кадров от 50 и выше
+    void setDithering(bool dithering);
+
+    void play(int address, const LedAnimation& animation);
+    void stop(int address);
+    void stopAll();
+    bool isPlaying(int address) const { return mTracks.contains(address); }
+
+    int droppedFrames() const { return mDropped; } // пропущено из-за опоздания таймера
+
+signals:
+    void frame(int address, const QByteArray& leds); // полный кадр CMD_SET_SMART_LEDS
+    void finished(int address); // анимация без повтора доиграла
+
+private slots:
+    void tick();
+    void requestDropped(int address, int command, const QByteArray& data);
+};
+
+} // namespace qrc
+
+#endif // _QRC_ANIMATOR_HPP_
@@ -0,0 +1,95 @@
+/******************************************************************************
+ *
+ * Quest Room Control
+ *
+ * Batched and frame-throttled change notifications
+ *
+ * (c) Roman A. Bulygin 2016
+ *
+ ******************************************************************************/
+
+#include "qrc_batch.hpp"
+
+#include <limits.h>
+
+namespace qrc {
+
+ChangeBatch::ChangeBatch(QObject *parent)
+    : QObject(parent)
+    , mTimer(this)
+    , mTop(INT_MAX)
+    , mLeft(INT_MAX)
+{
+    mTimer.setSingleShot(true);
+    connect(&mTimer, SIGNAL(timeout()), this, SLOT(tick()));
+}
+
+void ChangeBatch::begin()
+{
+    ++mDepth;
+}
+
+void ChangeBatch::end()
+{
+    if ((mDepth == 0) || (--mDepth > 0))
+        return;
+    flushCells();
+    if (mPending && !mTimer.isActive())
+        flushFrame();
+}
+
+void ChangeBatch::setFrameRate(int fps)
+{
+    mFrameRate = qBound(0, fps, int(QRC_MAX_FRAME_RATE));
+    if (mFrameRate == 0)
+    {
+        // Отложенное до конца кадра уходит сразу
+        mTimer.stop();
+        if (mPending && (mDepth == 0))
+            flushFrame();
+    }
+}
+
+void ChangeBatch::cellChanged(int row, int column)
+{
+    mTop = qMin(mTop, row);
+    mLeft = qMin(mLeft, column);
+    mBottom = qMax(mBottom, row);
+    mRight = qMax(mRight, column);
+    if (mDepth == 0)
+        flushCells();
+}
+
+void ChangeBatch::changed()
+{
+    mPending = true;
+    if ((mDepth == 0) && !mTimer.isActive())
+        flushFrame();
+}
+
+void ChangeBatch::flushCells()
+{
+    if (mBottom < 0)
+        return;
+    int top = mTop, left = mLeft, bottom = mBottom, right = mRight;
+    mTop = mLeft = INT_MAX;
+    mBottom = mRight = -1;
+    emit cellsChanged(top, left, bottom, right);
+}
+
+void ChangeBatch::flushFrame()
+{
+    mPending = false;
+    emit frame();
+    if (mFrameRate > 0)
+        mTimer.start(1000 / mFrameRate);
+}
+
+void ChangeBatch::tick()
+{
+    // Пакет, открытый дольше кадра, отправит всё сам по end()
+    if (mPending && (mDepth == 0))
+        flushFrame();
+}
+
+} // namespace qrc
@@ -0,0 +1,70 @@
+/******************************************************************************
+ *
+ * Quest Room Control
+ *
+ * Batched and frame-throttled change notifications
+ *
+ * (c) Roman A. Bulygin 2016
+ *
+ ******************************************************************************/
+
+#pragma once
+
+#ifndef _QRC_BATCH_HPP_
+#define _QRC_BATCH_HPP_
+
+#include <QObject>
+#include <QTimer>
+
+namespace qrc {
+
+// Частота кадров светодиодов: анимации и отправка правок из моделей
+enum {
+    QRC_DEFAULT_FRAME_RATE = 25,
+    QRC_MAX_FRAME_RATE = 100,
+};
+
+// Сборщик уведомлений об изменениях для табличной модели.
+// Изменённые ячейки копятся в охватывающем прямоугольнике, изменения выходов -
+// в флаге. Вне пакета ячейки уходят сигналом cellsChanged сразу, внутри пакета -
+// одним сигналом по end(). Сигнал frame (пора отправить выходы) идёт не чаще
+// частоты кадров: первое изменение после паузы - сразу, следующие - одним кадром
+// по таймеру, последнее состояние не теряется.
+class ChangeBatch : public QObject
+{
+    Q_OBJECT
+
+    QTimer mTimer;
+    int mFrameRate {QRC_DEFAULT_FRAME_RATE};
+    int mDepth {0};
+    bool mPending {false};
+    int mTop, mLeft, mBottom {-1}, mRight {-1};
+
+    void flushCells();
+    void flushFrame();
+public:
+    explicit ChangeBatch(QObject *parent = 0);
+
+    // Пакеты могут быть вложенными, уведомления уходят по последнему end()
+    void begin();
+    void end();
+    bool isActive() const { return mDepth > 0; }
+
+    // 0 - frame сразу после каждого изменения
+    void setFrameRate(int fps);
+    int frameRate() const { return mFrameRate; }
+
+    void cellChanged(int row, int column);
+    void changed(); // изменились выходы
+
+signals:
+    void cellsChanged(int top, int left, int bottom, int right);
+    void frame();
+
+private slots:
+    void tick();
+};
+
+} // namespace qrc
+
+#endif // _QRC_BATCH_HPP_
@@ -1,12 +1,14 @@
 #include <QByteArray>
 #include <QDateTime>
 
-#include <QSerialPort>
+#include <algorithm>
+
 #include <QSerialPortInfo>
 
 #include "qrc_connection.hpp"
 #include "qrc_protocol.hpp"
 #include "qrc_device.hpp"
+#include "qrc_transport.hpp"
 
 using namespace qrc;
 
@@ -18,120 +20,305 @@ void Protocol::requestHello() {}
 void Protocol::requestSetLeds() {}
 void Protocol::requestSetXLeds() {}
 
-static const int serialBaudrates[8] =
-{
-    QSerialPort::Baud9600,
-    14400,
-    QSerialPort::Baud19200,
-    28800,
-    QSerialPort::Baud38400,
-    QSerialPort::Baud57600,
-    76800,
-    QSerialPort::Baud115200,
-};
-
-enum {
-    TIMEOUT = 300, // ms
-};
-
 struct Connection::Impl
 {
-    QList<QSerialPortInfo> ports;
-    Device serial;
+    QStringList ports;     // последовательные порты и добавленные точки подключения
+    QStringList endpoints; // добавленные через addEndpoint
+    QList<Device*> buses; // шина N обслуживается buses[N] в своём потоке
+    int scanPending {0};  // сколько шин ещё ищут платы
+    QList<int> scanFound; // найденные узлы
+    InputTracker inputs;  // прошлые состояния входов по адресам
+    RuleTable rules;      // правила квеста, у каждой шины та же копия
+
+    void closeAll()
+    {
+        qDeleteAll(buses); // Device закрывает порт и дожидается потока
+        buses.clear();
+        scanPending = 0;
+        inputs.clear();
+    }
 };
 
 Connection::Connection(QObject *parent)
     : QObject(parent)
     , pImpl(new Impl)
-{
-    connect(&pImpl->serial, SIGNAL(error(QString)),                this, SIGNAL(error(QString)));
-    connect(&pImpl->serial, SIGNAL(parse_error(int, QByteArray)),  this, SIGNAL(parseError(int, QByteArray)));
-    connect(&pImpl->serial, SIGNAL(reply_silent(int, int)),        this, SIGNAL(replySilent(int, int)));
-    connect(&pImpl->serial, SIGNAL(reply(int, int, QByteArray)),   this, SLOT(parseReply(int, int, QByteArray)));
-    connect(&pImpl->serial, SIGNAL(timeout(int, int, QByteArray)), this, SIGNAL(timeout(int, int, QByteArray)));
-}
+{}
 
 Connection::~Connection()
 {
-    // Necessary to support pImpl destruction
+    pImpl->closeAll();
 }
 
 QStringList Connection::getPorList()
 {
-    pImpl->ports = QSerialPortInfo::availablePorts();
+    pImpl->ports.clear();
+    for (const auto& info : QSerialPortInfo::availablePorts())
+    {
+        pImpl->ports.append(info.portName());
+    }
+    pImpl->ports.append(pImpl->endpoints);
+    return pImpl->ports;
+}
 
-    QStringList result;
-    for (const auto& info : pImpl->ports)
+int Connection::addEndpoint(const QString& endpoint)
+{
+    // Последовательные порты уже в списке
+    if (!getPorList().contains(endpoint))
     {
-        result.append(info.portName());
+        pImpl->endpoints.append(endpoint);
+        getPorList();
     }
-    return result;
+    return pImpl->ports.indexOf(endpoint);
 }
 
-void Connection::start(int index, int baudrate)
+int Connection::busCount() const
 {
-    if ((index < 0) || (pImpl->ports.size() <= index))
+    return pImpl->buses.size();
+}
+
+Device* Connection::route(int address)
+{
+    int bus = nodeBus(address);
+    if ((bus < 0) || (pImpl->buses.size() <= bus))
     {
-        emit error(QString(tr("Неверный индекс устройства: %1")).arg(index));
-        emit stopped();
+        emit error(QString(tr("Шина %1 не подключена")).arg(bus));
+        return 0;
     }
+    return pImpl->buses[bus];
+}
+
+void Connection::send(int address, int command, const QByteArray& data, int maxAge)
+{
+    if (Device* device = route(address))
+        device->request(address, command, data, qrc::PRIORITY_DEFAULT, maxAge);
+}
+
+void Connection::start(int index, int baudrate)
+{
     if((baudrate < BAUDRATE_9600) || (BAUDRATE_115200 < baudrate))
     {
         emit error(QString(tr("Неверный индекс скорости %1")).arg(baudrate));
         emit stopped();
+        return;
     }
-    if(pImpl->ports[index].isNull())
-    {
-        emit error(QString(tr("Порт %1 не установлен")).arg(index));
+
+    pImpl->closeAll();
+    if (addBus(index) < 0)
         emit stopped();
+}
+
+int Connection::addBus(int index)
+{
+    if ((index < 0) || (pImpl->ports.size() <= index))
+    {
+        emit error(QString(tr("Неверный индекс устройства: %1")).arg(index));
+        return -1;
     }
-    if(pImpl->ports[index].isBusy())
+    Transport* transport = createTransport(pImpl->ports[index]);
+    if (transport == 0)
     {
-        emit error(QString(tr("Порт %1 занят")).arg(index));
-        emit stopped();
+        emit error(QString(tr("Порт %1 не установлен")).arg(pImpl->ports[index]));
+        return -1;
     }
+    return addBus(transport);
+}
 
+int Connection::addBus(Transport* transport)
+{
     // Connect to port
-
-    if (pImpl->serial.open(pImpl->ports[index]))
-    {
-        emit started();
-    }
-    else
+    int bus = pImpl->buses.size();
+    Device* device = createBus();
+    if (!device->open(transport, bus))
     {
-        emit error(QString(tr("Порт %1 не соединяется")).arg(index));
-        emit stopped();
+        delete device;
+        emit error(QString(tr("Порт не соединяется")));
+        return -1;
     }
+    return appendBus(device);
+}
+
+Device* Connection::createBus()
+{
+    Device* device = new Device;
+
+    connect(device, SIGNAL(error(QString)),                this, SIGNAL(error(QString)));
+    connect(device, SIGNAL(parse_error(int, QByteArray)),  this, SIGNAL(parseError(int, QByteArray)));
+    connect(device, SIGNAL(reply_silent(int, int)),        this, SIGNAL(replySilent(int, int)));
+    connect(device, SIGNAL(reply(int, int, QByteArray)),   this, SLOT(parseReply(int, int, QByteArray)));
+    connect(device, SIGNAL(snapshot(qrc::StateSnapshot)),  this, SLOT(trackState(qrc::StateSnapshot)));
+    connect(device, SIGNAL(timeout(int, int, QByteArray)), this, SIGNAL(timeout(int, int, QByteArray)));
+    connect(device, SIGNAL(dropped(int, int, QByteArray)), this, SIGNAL(dropped(int, int, QByteArray)));
+    connect(device, SIGNAL(baudRateChanged(int, int)),     this, SIGNAL(baudRateChanged(int, int)));
+    connect(device, SIGNAL(scanFinished(int, int)),        this, SLOT(busScanned(int, int)));
+    connect(device, SIGNAL(ruleFired(int, int)),           this, SIGNAL(ruleFired(int, int)));
+    connect(device, SIGNAL(ruleForward(qrc::RuleAction)),  this, SLOT(forwardRuleAction(qrc::RuleAction)));
+
+    return device;
+}
+
+int Connection::appendBus(Device* device)
+{
+    int bus = pImpl->buses.size();
+    pImpl->buses.append(device);
+    if (!pImpl->rules.isNull())
+        device->setRules(pImpl->rules);
+    if (bus == 0)
+        emit started();
+    return bus;
 }
 
 void Connection::stop()
 {
-    pImpl->serial.close();
+    pImpl->closeAll();
     emit stopped();
 }
 
+void Connection::cancel(int address, int command)
+{
+    if (Device* device = route(address))
+        device->cancel(address, command);
+}
 
-void Connection::requestSetBaudRate(int baudrate)
+void Connection::requestSetBaudRate(int address, int baudrate)
 {
     if((baudrate < BAUDRATE_9600) || (BAUDRATE_115200 < baudrate))
     {
         emit error(QString(tr("Неверный индекс скорости %1")).arg(baudrate));
+        return;
+    }
+    if (Device* device = route(address))
+        device->setBaudRate(address, baudrate);
+}
+
+void Connection::setPolling(int address, int interval, int command)
+{
+    if (Device* device = route(address))
+        device->setPolling(address, interval, command);
+}
+
+void Connection::setPollBudget(int bus, int pollsPerSecond)
+{
+    if (Device* device = route(nodeAddress(bus, 0)))
+        device->setPollBudget(pollsPerSecond);
+}
+
+void Connection::setQueueLimit(int bus, int priority, int depth, int maxAge)
+{
+    if (Device* device = route(nodeAddress(bus, 0)))
+        device->setQueueLimit(priority, depth, maxAge);
+}
+
+void Connection::setInputThresholds(int slider, int encoder, int sensor)
+{
+    pImpl->inputs.setThresholds(slider, encoder, sensor);
+}
+
+void Connection::trackState(const StateSnapshot& state)
+{
+    emit replyState(state);
+
+    InputEvent events[InputTracker::MAX_EVENTS];
+    int count = pImpl->inputs.update(state, events);
+    for (int i = 0; i < count; ++i)
+    {
+        const InputEvent& e = events[i];
+        switch (e.kind)
+        {
+        case InputEvent::KEY_DOWN:
+        case InputEvent::KEY_UP:
+            emit keyChanged(e.address, e.index, e.kind == InputEvent::KEY_DOWN);
+            break;
+        case InputEvent::STIKY_KEY:
+            emit stikyKeyChanged(e.address, e.index, e.value != 0);
+            break;
+        case InputEvent::SLIDER:
+            emit sliderChanged(e.address, e.index, e.value);
+            break;
+        case InputEvent::ENCODER:
+            emit encoderMoved(e.address, e.index, e.value, e.delta);
+            break;
+        case InputEvent::SENSOR:
+            emit sensorChanged(e.address, e.index, e.value);
+            break;
+        }
+    }
+}
+
+bool Connection::loadRules(const QString& fileName)
+{
+    QSharedPointer<RuleSet> set(new RuleSet);
+    QString message;
+    if (!set->load(fileName, message))
+    {
+        emit error(message);
+        return false;
+    }
+    setRules(set);
+    return true;
+}
+
+void Connection::setRules(const RuleTable& table)
+{
+    pImpl->rules = table;
+    for (Device* device : pImpl->buses)
+        device->setRules(table);
+}
+
+RuleTable Connection::rules() const
+{
+    return pImpl->rules;
+}
+
+void Connection::forwardRuleAction(const qrc::RuleAction& action)
+{
+    // Действие на узел другой шины: сработало в одном потоке шины, выполнит другой
+    if (Device* device = route(action.address))
+        device->runRuleAction(action);
+}
+
+void Connection::scan()
+{
+    if (pImpl->scanPending > 0) // уже ищем
+        return;
+    pImpl->scanFound.clear();
+    if (pImpl->buses.isEmpty())
+    {
+        emit discovered(pImpl->scanFound);
+        return;
+    }
+    // Шины работают в своих потоках, так что ищем на всех одновременно
+    pImpl->scanPending = pImpl->buses.size();
+    for (Device* device : pImpl->buses)
+        device->scan();
+}
+
+void Connection::busScanned(int bus, int boards)
+{
+    if (pImpl->scanPending <= 0)
+        return;
+    for (int board = 0; board < 16; ++board)
+        if (boards & (1 << board))
+            pImpl->scanFound.append(nodeAddress(bus, board));
+    if (--pImpl->scanPending == 0)
+    {
+        std::sort(pImpl->scanFound.begin(), pImpl->scanFound.end());
+        emit discovered(pImpl->scanFound);
     }
 }
 
 void Connection::requestHello(int address)
 {
-    pImpl->serial.request(address, qrc::CMD_HELLO, QByteArray());
+    send(address, qrc::CMD_HELLO, QByteArray());
 }
 
 void Connection::requestSetLeds(int address, const QByteArray& leds)
 {
-    pImpl->serial.request(address, qrc::CMD_SET_LEDS, leds);
+    send(address, qrc::CMD_SET_LEDS, leds);
 }
 
-void Connection::requestSetSmartLeds(int address, const QByteArray& leds)
+void Connection::requestSetSmartLeds(int address, const QByteArray& leds, int maxAge)
 {
-    pImpl->serial.request(address, qrc::CMD_SET_SMART_LEDS, leds);
+    send(address, qrc::CMD_SET_SMART_LEDS, leds, maxAge);
 }
 
 void Connection::requestSmartLed(int address, int group, int r, int g , int b)
@@ -149,56 +336,55 @@ void Connection::requestSmartLed(int address, int group, int r, int g , int b)
             .append(char((b>>8) & 0x0F))
             .append(char(b & 0xFF));
 
-    pImpl->serial.request(address, qrc::SET_SPECIFIC_SMART_LED, data);
+    send(address, qrc::SET_SPECIFIC_SMART_LED, data);
 }
 
 void Connection::requestSetRelays(int address, unsigned char relays)
 {
     QByteArray data;
     data.append(char(relays));
-    pImpl->serial.request(address, qrc::CMD_SET_RELAY, data);
+    send(address, qrc::CMD_SET_RELAY, data);
 }
 
 void Connection::requestGetKeys(int address)
 {
-    pImpl->serial.request(address, qrc::CMD_GET_KEYS, QByteArray());
+    send(address, qrc::CMD_GET_KEYS, QByteArray());
 }
 
 void Connection::requestGetSliders(int address)
 {
-    pImpl->serial.request(address, qrc::CMD_GET_SLIDERS, QByteArray());
+    send(address, qrc::CMD_GET_SLIDERS, QByteArray());
 }
 
 void Connection::requestGetSensors(int address)
 {
-    pImpl->serial.request(address, qrc::CMD_GET_SENSORS, QByteArray());
+    send(address, qrc::CMD_GET_SENSORS, QByteArray());
 }
 
 void Connection::requestGetEncoders(int address)
 {
-    pImpl->serial.request(address, qrc::CMD_GET_ENCODERS, QByteArray());
+    send(address, qrc::CMD_GET_ENCODERS, QByteArray());
 }
 
 void Connection::requestGetStikyKeys(int address)
 {
-    pImpl->serial.request(address, qrc::CMD_GET_STIKY_KEYS, QByteArray());
+    send(address, qrc::CMD_GET_STIKY_KEYS, QByteArray());
 }
 
 void Connection::requestGetState(int address)
 {
-    pImpl->serial.request(address, qrc::CMD_GET_STATE, QByteArray());
+    send(address, qrc::CMD_GET_STATE, QByteArray());
 }
 
 void Connection::parseReply(int address, int command, const QByteArray& data)
 {
-    Q_UNUSED(address)
     switch (command)
     {
     case CMD_HELLO:
-        emit replyHello();
+        emit replyHello(address);
         break;
     case CMD_SET_BAUDRATE:
-        emit replyBaudrate();
+        emit replyBaudrate(address);
         break;
 
     // Команды установки значений
@@ -214,47 +400,49 @@ void Connection::parseReply(int address, int command, const QByteArray& data)
     // Команды получения значений
     case CMD_GET_KEYS:
     {
-        emit replyKeys(getKeys(data));
+        emit replyKeys(address, getKeys(data));
         break;
     }
     case CMD_GET_SLIDERS:
     {
-        emit replySliders(getSliders(data));
+        emit replySliders(address, getSliders(data));
         break;
     }
     case CMD_GET_ENCODERS:
     {
-        emit replyEncoders(getEncoders(data));
+        emit replyEncoders(address, getEncoders(data));
         break;
     }
     case CMD_GET_SENSORS:
     {
-        emit replySensors(getSensors(data));
+        emit replySensors(address, getSensors(data));
         break;
     }
     case CMD_GET_STIKY_KEYS:
     {
-        emit replyStikyKeys(getKeys(data));
+        emit replyStikyKeys(address, getKeys(data));
         break;
     }
     case CMD_GET_STATE:
     {
-        emit replyState(
-                    getKeys(data.mid(0, 3)),
-                    getSliders(data.mid(3, 8)),
-                    getEncoders(data.mid(11, 8)),
-                    getSensors(data.mid(19, 2)),
-                    getKeys(data.mid(21, 3))
-                    );
+        // Обычно разбирается ещё в потоке шины (Device::snapshot), сюда попадает только в обход него
+        StateSnapshot state;
+        if (!decodeState(reinterpret_cast<const unsigned char*>(data.constData()), data.size(), address,
+                         QDateTime::currentMSecsSinceEpoch(), state))
+        {
+            emit parseError(PARSE_SIZE_ERROR, data); // усечённый снимок в трекер не пускаем
+            break;
+        }
+        trackState(state);
         break;
     }
 
     // Телеграммы
     case CMD_SUCCESS:
-        emit replyTicketSuccess();
+        emit replyTicketSuccess(address);
         break;
     case CMD_UNKNOWN:
-        emit replyTicketUnknown();
+        emit replyTicketUnknown(address);
         break;
     default:
         emit reply(address, command, data);
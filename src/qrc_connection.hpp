@@ -19,9 +19,15 @@
 #include <QStringList>
 
 #include "qrc_protocol.hpp"
+#include "qrc_rules.hpp"
+#include "qrc_state.hpp"
+
+class Device;
 
 namespace qrc {
 
+class Transport;
+
 class Protocol :public QObject
 {
     Q_OBJECT
@@ -38,17 +44,40 @@ public slots:
     void requestSetXLeds();
 };
 
+// Подключение к нескольким шинам сразу: у каждого порта свой поток обмена.
+// Все адреса в запросах и сигналах - адреса узлов qrc::nodeAddress(шина, плата),
+// для единственной шины (шина 0) они совпадают с адресами плат.
 class Connection : public QObject
 {
     Q_OBJECT
 
     struct Impl;
     QScopedPointer<Impl> pImpl;
+
+    Device* route(int address);
+    void send(int address, int command, const QByteArray& data, int maxAge = 0);
+    Device* createBus();
+    int appendBus(Device* device);
 public:
     explicit Connection(QObject *parent = 0);
     virtual ~Connection() override;
 public:
     QStringList getPorList(); // return list of available ports
+    // Добавить в список портов точку подключения "tcp://host:port" или "local:name"
+    // (имя последовательного порта уже в списке). Возвращает её индекс в getPorList().
+    int addEndpoint(const QString& endpoint);
+
+    // Подключить порт с индексом из getPorList() очередной шиной. Возвращает номер шины или -1.
+    int addBus(int index);
+    // Подключить шиной готовый транспорт (например qrc::SimulatorTransport), Connection становится владельцем
+    int addBus(Transport* transport);
+    int busCount() const;
+
+    // Правила квеста из файла (см. qrc::RuleSet) для всех шин, в том числе подключённых позже.
+    // При ошибке правила не меняются, а описание уходит в error().
+    bool loadRules(const QString& fileName);
+    void setRules(const RuleTable& table);
+    RuleTable rules() const;
 
     enum Relay // Константы для установки релюх
     {
@@ -63,38 +92,69 @@ signals:
     void error(const QString& message);
     void parseError(int error, const QByteArray& data); // ошибка разбора
     void replySilent(int address, int command); // типа ответ от команд которые не возвращают ответа (при посылке на адреса 0x00, 0x0F)
-    void replyTicketSuccess();
-    void replyTicketUnknown();
+    void replyTicketSuccess(int address);
+    void replyTicketUnknown(int address);
     void reply(int address, int command, const QByteArray& data);
     void timeout(int address, int command, const QByteArray& data); // ответа не дождались
+    void dropped(int address, int command, const QByteArray& data); // запрос выброшен из очереди не отправленным
 
     void started();
     void stopped();
 //    void replySetBaudRate(int address);
     // Ответы
-    void replyHello();
-    void replyBaudrate();
-
-
-    void replyKeys(QList<bool>);
-    void replySliders(QList<int>);
-    void replySensors(QList<int>);
-    void replyEncoders(QList<int>);
-    void replyStikyKeys(QList<bool>);
-    void replyState(QList<bool> keys,
-                    QList<int> sliders,
-                    QList<int> encoders,
-                    QList<int> sensors,
-                    QList<bool> stiky);
+    void replyHello(int address);
+    void replyBaudrate(int address);
+    void baudRateChanged(int bus, int baudrate); // шина перешла на скорость с индексом BAUDRATE_*
+    void discovered(QList<int> addresses); // поиск плат на всех шинах закончен, адреса узлов ответивших
+
+
+    void replyKeys(int address, QList<bool>);
+    void replySliders(int address, QList<int>);
+    void replySensors(int address, QList<int>);
+    void replyEncoders(int address, QList<int>);
+    void replyStikyKeys(int address, QList<bool>);
+    void replyState(const qrc::StateSnapshot& state);
+
+    // Изменения входов между опросами (см. qrc::InputTracker). Первый ответ платы
+    // событий не даёт, его видно только в replyState.
+    void keyChanged(int address, int key, bool down);
+    void stikyKeyChanged(int address, int key, bool stiky);
+    void sliderChanged(int address, int slider, int value);
+    void encoderMoved(int address, int encoder, int value, int delta);
+    void sensorChanged(int address, int sensor, int value);
+
+    // Правило из строки line файла правил сработало по снимку узла address.
+    // Его действия к этому моменту уже в очереди шины.
+    void ruleFired(int address, int line);
 public slots:
-    void start(int index, int baudrate);
-    void stop();
-
-    void requestSetBaudRate(int baudrate);
+    void start(int index, int baudrate); // одна шина: закрыть все и подключить порт шиной 0
+    void stop(); // закрыть все шины
+
+    // Отменить ещё не отправленные запросы на адрес (command < 0 - все команды)
+    void cancel(int address, int command = -1);
+
+    // Смена скорости всей шины адреса: широковещательный CMD_SET_BAUDRATE, перестройка
+    // порта, проверка CMD_HELLO каждой уже отвечавшей платы, при неудаче - возврат на 9600.
+    // Плата в адресе не важна: скорость у линии одна.
+    void requestSetBaudRate(int address, int baudrate);
+
+    // Опрос плат по кругу в потоке шины: раз в interval мс командой command
+    // (interval <= 0 - перестать). Молчащие платы сами переходят на редкий опрос.
+    void setPolling(int address, int interval, int command = qrc::CMD_GET_STATE);
+    // Предел опросов в секунду на шину, 0 - без ограничения
+    void setPollBudget(int bus, int pollsPerSecond);
+    // Глубина очереди класса приоритета шины и предельный возраст запроса в мс (0 - без ограничения)
+    void setQueueLimit(int bus, int priority, int depth, int maxAge = 0);
+    // Пороги событий sliderChanged, encoderMoved и sensorChanged
+    void setInputThresholds(int slider, int encoder, int sensor);
+
+    // Поиск плат на всех шинах сразу, результат - discovered()
+    void scan();
 
     void requestHello(int address);
     void requestSetLeds(int address, const QByteArray& leds);
-    void requestSetSmartLeds(int address, const QByteArray& leds);
+    // maxAge - через сколько мс не ушедший кадр выбрасывается (0 - ждёт очереди)
+    void requestSetSmartLeds(int address, const QByteArray& leds, int maxAge = 0);
 
     void requestSmartLed(int address, int group, int r, int g , int b);
 
@@ -110,6 +170,9 @@ public slots:
 
 private slots:
     void parseReply(int address, int command, const QByteArray& data);
+    void busScanned(int bus, int boards);
+    void trackState(const qrc::StateSnapshot& state);
+    void forwardRuleAction(const qrc::RuleAction& action);
 
 };
 
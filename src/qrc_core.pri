@@ -0,0 +1,58 @@
+#-------------------------------------------------
+#
+# Hardware protocol and transports without GUI.
+# Shared by the application, the daemon and the benchmarks.
+#
+#-------------------------------------------------
+
+QT += core network
+QT -= gui
+
+equals(QT_MAJOR_VERSION, 4) {
+    CONFIG += serialport # QT 4
+}
+greaterThan(QT_MAJOR_VERSION, 4) {
+    QT += serialport #QT5
+}
+
+INCLUDEPATH += $$PWD
+DEPENDPATH += $$PWD
+
+SOURCES += \
+    $$PWD/qrc_animator.cpp \
+    $$PWD/qrc_batch.cpp \
+    $$PWD/qrc_connection.cpp \
+    $$PWD/qrc_device.cpp \
+    $$PWD/qrc_gamma.cpp \
+    $$PWD/qrc_ledencoder.cpp \
+    $$PWD/qrc_ledpack.cpp \
+    $$PWD/qrc_poller.cpp \
+    $$PWD/qrc_protocol.cpp \
+    $$PWD/qrc_rules.cpp \
+    $$PWD/qrc_scan.cpp \
+    $$PWD/qrc_scheduler.cpp \
+    $$PWD/qrc_simulator.cpp \
+    $$PWD/qrc_state.cpp \
+    $$PWD/qrc_timing.cpp \
+    $$PWD/qrc_transport.cpp
+
+HEADERS += \
+    $$PWD/qrc_animator.hpp \
+    $$PWD/qrc_batch.hpp \
+    $$PWD/qrc_connection.hpp \
+    $$PWD/qrc_device.hpp \
+    $$PWD/qrc_gamma.hpp \
+    $$PWD/qrc_ledencoder.hpp \
+    $$PWD/qrc_ledpack.hpp \
+    $$PWD/qrc_poller.hpp \
+    $$PWD/qrc_protocol.hpp \
+    $$PWD/qrc_ring.hpp \
+    $$PWD/qrc_rules.hpp \
+    $$PWD/qrc_scan.hpp \
+    $$PWD/qrc_scheduler.hpp \
+    $$PWD/qrc_simulator.hpp \
+    $$PWD/qrc_state.hpp \
+    $$PWD/qrc_timing.hpp \
+    $$PWD/qrc_transport.hpp
+
+QMAKE_CXXFLAGS += -std=c++11
@@ -1,150 +1,820 @@
 #include "qrc_device.hpp"
 
 #include "qrc_protocol.hpp"
+#include "qrc_timing.hpp"
 
 #include <QDateTime>
 #include <QThread>
 
+#include <string.h>
+
+// Служебные транзакции смены скорости
 enum {
-    TIMEOUT = 350
+    TAG_NONE = 0,
+    TAG_BAUD_SET,      // широковещательный CMD_SET_BAUDRATE, уходит на старой скорости
+    TAG_BAUD_VERIFY,   // CMD_HELLO известной плате уже на новой скорости
+    TAG_BAUD_FALLBACK, // широковещательный возврат плат на 9600
+    TAG_POLL,          // опрос по расписанию Poller
+    TAG_SCAN,          // CMD_HELLO поиска плат
+    TAG_LED_RESYNC,    // полный кадр умных светодиодов взамен потерянной записи
 };
 
-SerialWorker::SerialWorker(const QSerialPortInfo& info, QObject *parent)
+enum {
+    SCAN_FIRST_ADDRESS = 1,
+    SCAN_LAST_ADDRESS = 14,
+    SCAN_TURNAROUND = 15, // ms, сверх времени на линии: живая плата отвечает быстрее
+    BAUD_SETTLE = 10,     // ms, сверх времени на линии: буфер переходника и перестройка UART плат
+    RECONNECT_INTERVAL = 1000, // ms, между попытками восстановить связь с мостом
+};
+
+SerialWorker::SerialWorker(qrc::Transport* transport, int bus, QObject *parent)
     : QObject(parent)
-    , info(info)
+    , transport(transport)
+    , bus(bus)
+    , timer(this)
+    , pollTimer(this)
+    , reconnectTimer(this)
+    , portBaudRate(qrc::BAUDRATE_9600)
+    , pendingBaudRate(qrc::BAUDRATE_9600)
 {
+    // После включения все реле плат выключены
+    memset(relays, 0, sizeof(relays));
+    timer.setSingleShot(true);
+    connect(&timer, SIGNAL(timeout()), this, SLOT(timerExpired()));
+    pollTimer.setSingleShot(true);
+    connect(&pollTimer, SIGNAL(timeout()), this, SLOT(pollTick()));
+    reconnectTimer.setSingleShot(true);
+    connect(&reconnectTimer, SIGNAL(timeout()), this, SLOT(reconnect()));
+    clock.start();
 }
 
 SerialWorker::~SerialWorker()
 {}
 
-void SerialWorker::request(int address, int command, const QByteArray& data)
+bool SerialWorker::openPort()
 {
-    if (serial.isNull())
+    if (port != 0)
+        return true;
+    if (reconnectTimer.isActive()) // связь восстановит reconnect()
+        return false;
+
+    if (transport.isNull() || !transport->open())
     {
-        if (info.isNull())
+        emit error(transport.isNull() ? QString(tr("Нет данных для открытия порта")) : transport->errorString());
+        return false;
+    }
+
+    // После включения платы работают на 9600, быстрее - только через setBaudRate
+    portBaudRate = qrc::BAUDRATE_9600;
+    if (transport->canSetBaudRate())
+        transport->setBaudRate(qrc::baudRate(portBaudRate));
+
+    port = transport->device();
+    connect(port, SIGNAL(readyRead()), this, SLOT(readyRead()));
+    connect(port, SIGNAL(bytesWritten(qint64)), this, SLOT(bytesWritten(qint64)));
+    // Сокеты моста рвутся, последовательный порт - нет
+    if (port->metaObject()->indexOfSignal("disconnected()") >= 0)
+        connect(port, SIGNAL(disconnected()), this, SLOT(portDisconnected()));
+    return true;
+}
+
+// Порт открыт или связь с ним восстанавливается: запросы можно ставить в очередь
+bool SerialWorker::accepting()
+{
+    return openPort() || reconnectTimer.isActive();
+}
+
+void SerialWorker::portDisconnected()
+{
+    emit error(QString(tr("%1: связь потеряна, переподключение")).arg(transport->name()));
+    disconnect(port, 0, this, 0);
+    port = 0;
+    transport->close();
+    staleBytes = 0;
+    parser.reset();
+
+    // Ответа на текущий запрос уже не будет
+    if (state != STATE_IDLE)
+    {
+        timer.stop();
+        forgetLeds(current);
+        emit timeout(current.address, current.command, current.data);
+        completed(current, -1);
+        state = STATE_IDLE;
+    }
+    reconnectTimer.start(RECONNECT_INTERVAL);
+}
+
+void SerialWorker::reconnect()
+{
+    if (!openPort())
+    {
+        reconnectTimer.start(RECONNECT_INTERVAL);
+        return;
+    }
+    // Накопленное за время обрыва уходит сразу
+    startNext();
+}
+
+static inline bool isBroadcast(int address)
+{
+    return ((address & 0x0F) == 0) || ((address & 0x0F) == 15);
+}
+
+static inline bool isSmartLedCommand(int command)
+{
+    return (command == qrc::CMD_SET_SMART_LEDS)
+            || (command == qrc::SET_SPECIFIC_SMART_LEDS_8)
+            || (command == qrc::SET_SPECIFIC_SMART_LEDS_4)
+            || (command == qrc::SET_SPECIFIC_SMART_LED);
+}
+
+void SerialWorker::request(int address, int command, const QByteArray& data, int priority, int maxAge)
+{
+    if (!accepting())
+    {
+        emit dropped(address, command, data); // отправить некуда
+        return;
+    }
+
+    if (isSmartLedCommand(command) && isBroadcast(address))
+    {
+        // Широковещательная запись меняет все платы, а квитанций не будет
+        for (auto& encoder : smartLeds)
+            encoder.invalidate();
+        enqueue(address, command, data, priority, TAG_NONE, 0, maxAge);
+    }
+    else if (command == qrc::CMD_SET_SMART_LEDS)
+    {
+        // Полный кадр заменяем наименьшим по байтам набором команд
+        for (const auto& c : smartLeds[address & 0x0F].encode(data))
+            enqueue(address, c.command, c.data, priority, TAG_NONE, 0, maxAge);
+    }
+    else
+    {
+        if (isSmartLedCommand(command))
+            smartLeds[address & 0x0F].apply(command, data);
+        enqueue(address, command, data, priority, TAG_NONE, 0, maxAge);
+    }
+
+    if ((command == qrc::CMD_SET_RELAY) && !data.isEmpty())
+    {
+        if (isBroadcast(address))
         {
-            emit error(QString(tr("Нет данных для открытия порта")));
-            return;
+            memset(relays, data[0], sizeof(relays));
+            relaysKnown = 0xFFFF;
         }
-        if (info.isBusy())
+        else
         {
-            emit error(QString(tr("Порт %1 занят").arg(info.portName())));
-            return;
+            relays[address & 0x0F] = (unsigned char)data[0];
+            relaysKnown |= 1 << (address & 0x0F);
         }
+    }
+
+    if (state == STATE_IDLE)
+        startNext();
+}
 
-        serial.reset(new QSerialPort(info));
+void SerialWorker::enqueue(int address, int command, const QByteArray& data, int priority, int tag, int timeout, int maxAge)
+{
+    qrc::Transaction transaction;
+    transaction.address = address;
+    transaction.command = command;
+    transaction.data = data;
+    transaction.priority = (priority < 0) ? qrc::commandPriority(command) : priority;
+    transaction.queued = clock.elapsed();
+    transaction.tag = tag;
+    transaction.timeout = timeout;
+    transaction.maxAge = maxAge;
+    // Пачка поиска целиком и восстановление кадров (не больше одного на адрес) - сверх глубины очереди
+    transaction.reserved = (tag == TAG_SCAN) || (tag == TAG_LED_RESYNC);
+
+    QList<qrc::Transaction> stale;
+    scheduler.push(transaction, stale);
+    reportDropped(stale);
+}
 
-        serial->setBaudRate(9600);
-        serial->setDataBits(QSerialPort::Data8);
-        serial->setParity(QSerialPort::NoParity);
-        serial->setStopBits(QSerialPort::OneStop);
-        serial->setFlowControl(QSerialPort::NoFlowControl);
+void SerialWorker::cancel(int address, int command)
+{
+    QList<qrc::Transaction> stale;
+    scheduler.cancel(address, command, stale);
+    reportDropped(stale);
+}
 
-        if (!serial->open(QIODevice::ReadWrite))
+void SerialWorker::setQueueLimit(int priority, int depth, int maxAge)
+{
+    scheduler.setLimit(priority, depth);
+    scheduler.setMaxAge(priority, maxAge);
+}
+
+void SerialWorker::setBaudRate(int address, int baudrate)
+{
+    Q_UNUSED(address) // скорость у линии одна на все платы
+    if (qrc::baudRate(baudrate) == 0)
+    {
+        emit error(QString(tr("Неверный индекс скорости %1")).arg(baudrate));
+        return;
+    }
+    if (baudSwitching)
+    {
+        emit error(QString(tr("Смена скорости шины %1 уже идёт")).arg(bus));
+        return;
+    }
+    if (!openPort())
+        return;
+    if (!transport->canSetBaudRate())
+    {
+        emit error(QString(tr("%1: скорость задаётся в настройках моста")).arg(transport->name()));
+        return;
+    }
+
+    // Плата, перешедшая одна, отрезала бы от порта все остальные: переводим всю линию сразу
+    baudSwitching = true;
+    pendingBaudRate = baudrate;
+    QByteArray data;
+    data.append(char(baudrate));
+    enqueue(qrc::nodeAddress(bus, 0), qrc::CMD_SET_BAUDRATE, data, qrc::PRIORITY_OUTPUT, TAG_BAUD_SET);
+
+    if (state == STATE_IDLE)
+        startNext();
+}
+
+void SerialWorker::setPolling(int address, int interval, int command)
+{
+    if (!accepting())
+        return;
+    poller.setTarget(address, interval, command);
+    pollTimer.start(0);
+}
+
+void SerialWorker::setPollBudget(int pollsPerSecond)
+{
+    poller.setBudget(pollsPerSecond);
+    pollTimer.start(0);
+}
+
+void SerialWorker::pollTick()
+{
+    int address;
+    int command;
+    qint64 wait;
+    while (poller.next(clock.elapsed(), address, command, wait))
+        enqueue(address, command, QByteArray(), qrc::PRIORITY_POLL, TAG_POLL);
+
+    // Если все опросы в пути, таймер перезапустит их завершение
+    if (wait >= 0)
+        pollTimer.start(int(wait));
+
+    if (state == STATE_IDLE)
+        startNext();
+}
+
+void SerialWorker::scan()
+{
+    if (scanPending > 0) // уже ищем
+        return;
+    if (!openPort())
+    {
+        emit scanFinished(bus, 0);
+        return;
+    }
+
+    int baudrate = qrc::baudRate(portBaudRate);
+    int wire = qrc::wireTime(qrc::packetSize(0) * 2, baudrate);
+    scanFound = 0;
+    scanPending = SCAN_LAST_ADDRESS - SCAN_FIRST_ADDRESS + 1;
+    for (int board = SCAN_FIRST_ADDRESS; board <= SCAN_LAST_ADDRESS; ++board)
+    {
+        // Знакомой медленной плате даём столько, сколько она обычно отвечает
+        int timeout = wire + SCAN_TURNAROUND;
+        const qrc::RttEstimator& estimator = rttFor(board, qrc::CMD_HELLO);
+        if (estimator.samples() > 0)
+            timeout = qMax(timeout, estimator.timeout(wire));
+        enqueue(qrc::nodeAddress(bus, board), qrc::CMD_HELLO, QByteArray(), qrc::PRIORITY_DIAGNOSTIC, TAG_SCAN, timeout);
+    }
+
+    if (state == STATE_IDLE)
+        startNext();
+}
+
+void SerialWorker::scanDone(const qrc::Transaction& transaction, bool found)
+{
+    if (scanPending <= 0)
+        return;
+    if (found)
+        scanFound |= 1 << qrc::nodeBoard(transaction.address);
+    else
+        knownBoards &= ~(1 << qrc::nodeBoard(transaction.address)); // платы больше нет на шине
+    if (--scanPending == 0)
+        emit scanFinished(bus, scanFound);
+}
+
+bool SerialWorker::setPortBaudRate(int baudrate)
+{
+    if ((port == 0) || !transport->setBaudRate(qrc::baudRate(baudrate)))
+    {
+        emit error(QString(tr("Порт не переключается на %1 бод")).arg(qrc::baudRate(baudrate)));
+        return false;
+    }
+    portBaudRate = baudrate;
+    // Замеры на другой скорости не годятся
+    for (auto& board : rtt)
+        for (auto& estimator : board)
+            estimator.reset();
+    return true;
+}
+
+// Все известные платы ответили на новой скорости или кто-то из них промолчал
+void SerialWorker::baudVerified(bool ok)
+{
+    if (ok)
+    {
+        baudSwitching = false;
+        emit baudRateChanged(bus, portBaudRate);
+        return;
+    }
+    // Связи нет: возвращаем все платы на 9600 и возвращаемся сами
+    QByteArray data;
+    data.append(char(qrc::BAUDRATE_9600));
+    enqueue(qrc::nodeAddress(bus, 0), qrc::CMD_SET_BAUDRATE, data, qrc::PRIORITY_OUTPUT, TAG_BAUD_FALLBACK);
+}
+
+// Вызывается по завершении транзакции до перехода к следующей.
+// replyCommand - команда ответа, CMD_SUCCESS для команд без ответа, -1 если ответа нет.
+void SerialWorker::completed(const qrc::Transaction& transaction, int replyCommand)
+{
+    switch (transaction.tag)
+    {
+    case TAG_BAUD_SET:
+        // Команда ушла в линию целиком - платы уже на новой скорости, переходим и мы.
+        // Не ушла - часть плат могла переключиться: возвращаем всех на 9600.
+        if ((replyCommand < 0) || !setPortBaudRate(pendingBaudRate))
         {
-            serial.reset();
-            emit error(QString(tr("Не могу открыть порт %1").arg(info.portName())));
-            return;
+            baudVerified(false);
+            break;
+        }
+        // Проверяем каждую плату, которая уже отвечала на этой шине
+        baudVerifyPending = 0;
+        baudVerifyFailed = false;
+        for (int board = 1; board < 15; ++board)
+        {
+            if (knownBoards & (1 << board))
+            {
+                enqueue(qrc::nodeAddress(bus, board), qrc::CMD_HELLO, QByteArray(), qrc::PRIORITY_OUTPUT, TAG_BAUD_VERIFY);
+                ++baudVerifyPending;
+            }
         }
+        if (baudVerifyPending == 0) // проверить некем
+            baudVerified(true);
+        break;
+    case TAG_BAUD_VERIFY:
+        if (replyCommand < 0)
+            baudVerifyFailed = true;
+        if ((baudVerifyPending > 0) && (--baudVerifyPending == 0))
+            baudVerified(!baudVerifyFailed);
+        break;
+    case TAG_POLL:
+        if (replyCommand >= 0)
+            poller.replied(transaction.address);
+        else
+            poller.timedOut(transaction.address);
+        pollTimer.start(0);
+        break;
+    case TAG_SCAN:
+        scanDone(transaction, replyCommand >= 0);
+        break;
+    case TAG_BAUD_FALLBACK:
+        setPortBaudRate(qrc::BAUDRATE_9600);
+        baudSwitching = false;
+        emit error(QString(tr("Нет связи на %1 бод, возврат на 9600")).arg(qrc::baudRate(pendingBaudRate)));
+        emit baudRateChanged(bus, portBaudRate);
+        break;
+    default:
+        break;
     }
+}
 
-    QByteArray dataToSend = qrc::request(address, command, data);
+void SerialWorker::reportDropped(const QList<qrc::Transaction>& stale)
+{
+    for (const auto& t : stale)
+    {
+        forgetLeds(t);
+        if (t.tag == TAG_POLL)
+        {
+            poller.cancelled(t.address);
+            pollTimer.start(0);
+        }
+        if (t.tag == TAG_SCAN)
+            scanDone(t, false);
+        emit dropped(t.address, t.command, t.data);
+    }
+}
 
-    qint64 written = serial->write(dataToSend);
-    if (written != dataToSend.size())
+void SerialWorker::setRecordQueue(const QSharedPointer<BusQueue>& queue)
+{
+    records = queue;
+}
+
+bool SerialWorker::post(const BusRecord& record)
+{
+    if (records.isNull() || !records->ring.push(record))
+        return false; // переполнено - пусть идёт сигналом
+    if (!records->signalled.exchange(true))
+        emit recordsReady();
+    return true;
+}
+
+void SerialWorker::setRules(const qrc::RuleTable& table)
+{
+    rules.setRules(table);
+    rules.clear();
+}
+
+void SerialWorker::runRules(const qrc::StateSnapshot& input)
+{
+    if (rules.update(input, firedRules) == 0)
+        return;
+    const qrc::RuleSet& set = *rules.rules();
+    for (int index : firedRules)
     {
-        emit error(QString(tr("Ошибка записи. Записано %1 байт из %2")).arg(written).arg(dataToSend.size()));
+        const qrc::RuleTrigger& trigger = set.trigger(index);
+        for (int i = trigger.firstAction; i < trigger.firstAction + trigger.actionCount; ++i)
+        {
+            if (qrc::nodeBus(set.action(i).address) == bus)
+                enqueueAction(set.action(i));
+            else
+                emit ruleForward(set.action(i)); // другая шина - через её поток, копией: набор правил там может быть уже другим
+        }
+        emit ruleFired(input.address, trigger.line);
+    }
+}
+
+void SerialWorker::runRuleAction(const qrc::RuleAction& action)
+{
+    if (!accepting())
         return;
+    enqueueAction(action);
+    if (state == STATE_IDLE)
+        startNext();
+}
+
+// Команда действия ставится в очередь выходов, отправит её ближайший startNext
+void SerialWorker::enqueueAction(const qrc::RuleAction& action)
+{
+    int board = action.address & 0x0F;
+    QByteArray data;
+    if (action.kind == qrc::RuleAction::SMART_LED)
+    {
+        data.append(char(action.index))
+                .append(char((action.r >> 8) & 0x0F)).append(char(action.r & 0xFF))
+                .append(char((action.g >> 8) & 0x0F)).append(char(action.g & 0xFF))
+                .append(char((action.b >> 8) & 0x0F)).append(char(action.b & 0xFF));
+        smartLeds[board].apply(qrc::SET_SPECIFIC_SMART_LED, data);
+        enqueue(action.address, qrc::SET_SPECIFIC_SMART_LED, data, qrc::PRIORITY_OUTPUT);
+        return;
+    }
+
+    if (!(relaysKnown & (1 << board)))
+    {
+        // Своей записи реле ещё не было: что на них сейчас, знает только плата
+        emit error(QString(tr("Реле платы 0x%1 ещё не задавались, считаем их выключенными"))
+                   .arg(action.address, 2, 16, QLatin1Char('0')));
+        relaysKnown |= 1 << board; // дальше на плате ровно то, что отправим
     }
+    unsigned char mask = (unsigned char)(0x10 << action.index);
+    if (action.kind == qrc::RuleAction::RELAY_ON)
+        relays[board] |= mask;
+    else if (action.kind == qrc::RuleAction::RELAY_OFF)
+        relays[board] &= (unsigned char)~mask;
+    else
+        relays[board] ^= mask;
+    data.append(char(relays[board]));
+    enqueue(action.address, qrc::CMD_SET_RELAY, data, qrc::PRIORITY_OUTPUT);
+}
 
-    if((address == 0) || (address == 15)) // Команды по этим адресам не возвращают ответа
+void SerialWorker::forgetLeds(const qrc::Transaction& transaction)
+{
+    if (!isSmartLedCommand(transaction.command))
+        return;
+    qrc::SmartLedEncoder& encoder = smartLeds[transaction.address & 0x0F];
+
+    // Запись не дошла, а стоящие за ней частичные записи посчитаны поверх неё.
+    // Кадр, к которому они ведут, известен: отправляем его целиком, частичные
+    // записи на адрес он вытесняет при постановке в очередь.
+    if (!isBroadcast(transaction.address) && (transaction.tag != TAG_LED_RESYNC) && encoder.isValid())
     {
-        emit reply_silent(address, command);
+        enqueue(transaction.address, qrc::CMD_SET_SMART_LEDS, encoder.state().data(),
+                transaction.origin, TAG_LED_RESYNC);
         return;
     }
 
-    QByteArray readBuffer;
+    // Не дошёл и полный кадр (платы нет?) - что горит на плате, неизвестно.
+    // Частичные записи без основы бессмысленны, следующий кадр уйдёт целиком.
+    encoder.invalidate();
+    if (isBroadcast(transaction.address))
+        return;
+    QList<qrc::Transaction> stale;
+    scheduler.cancel(transaction.address, qrc::SET_SPECIFIC_SMART_LEDS_8, stale);
+    scheduler.cancel(transaction.address, qrc::SET_SPECIFIC_SMART_LEDS_4, stale);
+    scheduler.cancel(transaction.address, qrc::SET_SPECIFIC_SMART_LED, stale);
+    reportDropped(stale);
+}
+
+// Опрос и запись кадра плата обрабатывает разное время: оценки раздельно по классам команд
+qrc::RttEstimator& SerialWorker::rttFor(int address, int command)
+{
+    return rtt[address & 0x0F][qrc::commandPriority(command)];
+}
 
-    qint64 startTime = QDateTime::currentMSecsSinceEpoch();
-    do
+void SerialWorker::startNext()
+{
+    while ((state == STATE_IDLE) && (port != 0))
     {
-        if(( QDateTime::currentMSecsSinceEpoch() - startTime) > TIMEOUT) //
+        QList<qrc::Transaction> stale;
+        bool ready = scheduler.pop(clock.elapsed(), current, stale);
+        reportDropped(stale);
+        if (!ready)
+            break;
+
+        // Буфер переиспользуется: после первых пакетов память под запросы не выделяется
+        int size = qrc::packetSize(current.data.size());
+        if (writeBuffer.size() < size)
+            writeBuffer.resize(size);
+        qrc::encodeRequest(current.address, current.command,
+                           reinterpret_cast<const unsigned char*>(current.data.constData()), current.data.size(),
+                           reinterpret_cast<unsigned char*>(writeBuffer.data()));
+
+        // Всё, что пришло до начала транзакции, к ней не относится
+        parser.reset();
+
+        qint64 written = port->write(writeBuffer.constData(), size);
+        if (written != size)
         {
-            emit timeout(address, command, data);
-            return;
+            if (written > 0) // порт ещё сообщит об их уходе
+                staleBytes += written;
+            emit error(QString(tr("Ошибка записи. Записано %1 байт из %2")).arg(written).arg(size));
+            // Как и по таймауту: опрос, поиск и смена скорости ждут завершения своей транзакции
+            forgetLeds(current);
+            emit dropped(current.address, current.command, current.data);
+            completed(current, -1);
+            continue;
         }
 
-        if (!serial->waitForReadyRead(25))
-            continue;
+        // Таймаут по длине запроса, ожидаемого ответа, скорости и повадкам платы
+        int baudrate = qrc::baudRate(portBaudRate);
+        int wire = qrc::wireTime(size + qrc::packetSize(qrc::replySize(current.command)), baudrate);
+        sentAt = clock.elapsed();
+        sentBytes = size;
 
-        readBuffer.append(serial->readAll());
+        pendingBytes = written;
+        state = STATE_WRITING;
+        timer.start((current.timeout > 0) ? current.timeout : rttFor(current.address, current.command).timeout(wire));
+    }
+}
+
+void SerialWorker::finish()
+{
+    // Ответ или таймаут раньше сообщения порта: его байтами не гасить следующий запрос
+    if ((state == STATE_WRITING) && (pendingBytes > 0))
+        staleBytes += pendingBytes;
+    pendingBytes = 0;
+    timer.stop();
+    state = STATE_IDLE;
+    startNext();
+}
 
-        unsigned char reply_address;
-        unsigned char reply_command;
-        QByteArray reply_data;
-        switch(int perror = qrc::parse(readBuffer, reply_address, reply_command, reply_data))
+void SerialWorker::bytesWritten(qint64 bytes)
+{
+    // Порт сообщает по порядку записи: сначала долги уже завершённых транзакций
+    qint64 stale = qMin(staleBytes, bytes);
+    staleBytes -= stale;
+    bytes -= stale;
+    if ((state != STATE_WRITING) || (bytes <= 0))
+        return;
+
+    pendingBytes -= bytes;
+    if (pendingBytes > 0)
+        return;
+
+    if(isBroadcast(current.address)) // Команды по адресам 0x00 и 0x0F не возвращают ответа
+    {
+        emit reply_silent(current.address, current.command);
+        if ((current.tag == TAG_BAUD_SET) || (current.tag == TAG_BAUD_FALLBACK))
         {
-        case qrc::PARSE_NONE: // Мало данных
+            // bytesWritten - байты только в буфере системы. Переключать порт можно,
+            // когда хвост команды уйдёт на старой скорости.
+            transport->flush();
+            state = STATE_DRAINING;
+            timer.start(qrc::wireTime(sentBytes, qrc::baudRate(portBaudRate)) + BAUD_SETTLE);
+            return;
+        }
+        completed(current, qrc::CMD_SUCCESS);
+        finish();
+        return;
+    }
+    state = STATE_READING;
+}
 
+void SerialWorker::readyRead()
+{
+    // Читаем прямо в буфер разбора, разбирая по мере заполнения
+    forever
+    {
+        int space;
+        char* tail = parser.tail(space);
+        qint64 size = port->read(tail, space);
+        if (size <= 0)
             break;
+        parser.commit(int(size));
+        parseInput();
+    }
+}
+
+void SerialWorker::parseInput()
+{
+    qrc::StreamParser::Packet packet;
+    while (parser.next(packet))
+    {
+        switch(packet.result)
+        {
         case qrc::PARSE_SUCCESS: // Отлично
-            emit reply(reply_address, reply_command, reply_data);
-            return;
+        {
+            BusRecord record;
+            record.address = qrc::nodeAddress(bus, packet.address);
+            record.command = packet.command;
+            record.size = packet.size;
+            bool valid = true;
+            if (packet.command == qrc::CMD_GET_STATE) // самый частый ответ - разбираем прямо из буфера
+            {
+                record.kind = BusRecord::RECORD_STATE;
+                valid = qrc::decodeState(packet.data, packet.size, record.address,
+                                         QDateTime::currentMSecsSinceEpoch(), record.state);
+                if (!valid)
+                {
+                    // Нули вместо недостающих байт - ложные отпускания кнопок и срабатывания правил
+                    emit parse_error(qrc::PARSE_SIZE_ERROR, packet.toByteArray());
+                }
+                else
+                {
+                    runRules(record.state); // выходы уйдут следующей же транзакцией
+                    if (!post(record))
+                        emit snapshot(record.state);
+                }
+            }
+            else
+            {
+                record.kind = BusRecord::RECORD_REPLY;
+                bool fits = (packet.size <= BusRecord::MAX_DATA);
+                if (fits)
+                    memcpy(record.data, packet.data, size_t(packet.size));
+                if (!fits || !post(record))
+                    emit reply(record.address, packet.command, packet.toByteArray());
+            }
+            // Ответ может прийти раньше, чем порт сообщит об уходе последних байт запроса
+            if (((state == STATE_WRITING) || (state == STATE_READING)) && (packet.address == (current.address & 0x0F)))
+            {
+                knownBoards |= 1 << packet.address;
+                if (packet.command == qrc::CMD_UNKNOWN)
+                    forgetLeds(current);
+                int wire = qrc::wireTime(sentBytes + qrc::packetSize(packet.size), qrc::baudRate(portBaudRate));
+                rttFor(current.address, current.command).sample(int(clock.elapsed() - sentAt) - wire);
+                completed(current, valid ? packet.command : -1);
+                finish();
+            }
+            break;
+        }
         case qrc::PARSE_SKIPPED: // not a packet. data - skipped bytes
-            emit parse_error(perror, reply_data);
+            emit parse_error(packet.result, packet.toByteArray());
             break; // possibly it may be more data
         case qrc::PARSE_SIZE_ERROR: // wrong size packet (even bytes in packet) data - wrong packet
         case qrc::PARSE_TAG_ERROR:  // some tag skipped. data -  wrong packet
         case qrc::PARSE_CRC_ERROR:  // wrong crc in the packet. data -  wrong packet
         default:
-            emit parse_error(perror, reply_data);
-            return;
+            emit parse_error(packet.result, packet.toByteArray());
+            if ((state == STATE_WRITING) || (state == STATE_READING)) // Битый ответ ждать дальше смысла нет
+            {
+                forgetLeds(current);
+                completed(current, -1);
+                finish();
+            }
+            break;
         }
     }
-    while(1);
+    // Ответ без запроса тоже мог запустить правила
+    if (state == STATE_IDLE)
+        startNext();
+}
+
+void SerialWorker::timerExpired()
+{
+    if (state == STATE_IDLE)
+        return;
+    if (state == STATE_DRAINING)
+    {
+        completed(current, qrc::CMD_SUCCESS);
+        finish();
+        return;
+    }
+    forgetLeds(current);
+    rttFor(current.address, current.command).timedOut();
+    emit timeout(current.address, current.command, current.data);
+    completed(current, -1);
+    finish();
 }
 
 struct Device::Impl
 {
     QThread thread;
+    QSharedPointer<BusQueue> records {new BusQueue};
 };
 
 Device::Device(QObject *parent)
     : QObject(parent)
     , pImpl(new Impl)
-{}
+{
+    qrc::registerStateMetaType();
+    qrc::registerRulesMetaType();
+}
 
 Device::~Device()
 {
     close();
 }
 
-bool Device::open(const QSerialPortInfo& info)
+bool Device::open(const QSerialPortInfo& info, int bus)
+{
+    if (info.isNull() || info.isBusy())
+    {
+        close();
+        return false;
+    }
+    return open(new qrc::SerialTransport(info), bus);
+}
+
+bool Device::open(QIODevice* device, int bus)
+{
+    if (device == 0)
+    {
+        close();
+        return false;
+    }
+    return open(new qrc::DeviceTransport(device), bus);
+}
+
+bool Device::open(qrc::Transport* transport, int bus)
 {
     close();
 
-    if (info.isNull() || info.isBusy())
+    if (transport == 0)
         return false;
 
     // тут мы запускаем поток, который собственно будет обрабатывать ком-порт
-    SerialWorker* worker = new SerialWorker(info);
-    worker->moveToThread(&pImpl->thread);
+    transport->moveToThread(&pImpl->thread);
+    SerialWorker* worker = new SerialWorker(transport, bus);
+    worker->setRecordQueue(pImpl->records);
+    start(worker);
+
+    // Порт открывается в потоке обмена, но занятый или пропавший порт должен быть виден сразу
+    bool opened = false;
+    QMetaObject::invokeMethod(worker, "openPort", Qt::BlockingQueuedConnection, Q_RETURN_ARG(bool, opened));
+    if (!opened)
+    {
+        close(); // причину openPort уже сообщил сигналом error
+        return false;
+    }
+    return true;
+}
+
+void Device::start(SerialWorker* worker)
+{
     worker->moveToThread(&pImpl->thread);
 
     connect(&pImpl->thread, SIGNAL(finished()), worker, SLOT(deleteLater()));
 
-    connect(this, SIGNAL(requestWorker(int, int, QByteArray)), worker, SLOT(request(int, int, QByteArray)));
+    connect(this, SIGNAL(requestWorker(int, int, QByteArray, int, int)), worker, SLOT(request(int, int, QByteArray, int, int)));
+    connect(this, SIGNAL(cancelWorker(int, int)),                   worker, SLOT(cancel(int, int)));
+    connect(this, SIGNAL(queueLimitWorker(int, int, int)),          worker, SLOT(setQueueLimit(int, int, int)));
+    connect(this, SIGNAL(baudRateWorker(int, int)),                 worker, SLOT(setBaudRate(int, int)));
+    connect(this, SIGNAL(pollingWorker(int, int, int)),             worker, SLOT(setPolling(int, int, int)));
+    connect(this, SIGNAL(pollBudgetWorker(int)),                    worker, SLOT(setPollBudget(int)));
+    connect(this, SIGNAL(scanWorker()),                             worker, SLOT(scan()));
+    connect(this, SIGNAL(rulesWorker(qrc::RuleTable)),              worker, SLOT(setRules(qrc::RuleTable)));
+    connect(this, SIGNAL(ruleActionWorker(qrc::RuleAction)),        worker, SLOT(runRuleAction(qrc::RuleAction)));
 
     connect(worker, SIGNAL(error(QString)),                this, SIGNAL(error(QString)));
     connect(worker, SIGNAL(parse_error(int, QByteArray)),  this, SIGNAL(parse_error(int, QByteArray)));
     connect(worker, SIGNAL(reply_silent(int, int)),        this, SIGNAL(reply_silent(int, int)));
     connect(worker, SIGNAL(reply(int, int, QByteArray)),   this, SIGNAL(reply(int, int, QByteArray)));
+    connect(worker, SIGNAL(snapshot(qrc::StateSnapshot)),  this, SIGNAL(snapshot(qrc::StateSnapshot)));
     connect(worker, SIGNAL(timeout(int, int, QByteArray)), this, SIGNAL(timeout(int, int, QByteArray)));
+    connect(worker, SIGNAL(dropped(int, int, QByteArray)), this, SIGNAL(dropped(int, int, QByteArray)));
+    connect(worker, SIGNAL(baudRateChanged(int, int)),     this, SIGNAL(baudRateChanged(int, int)));
+    connect(worker, SIGNAL(scanFinished(int, int)),        this, SIGNAL(scanFinished(int, int)));
+    connect(worker, SIGNAL(recordsReady()),                this, SLOT(drain()));
+    connect(worker, SIGNAL(ruleFired(int, int)),           this, SIGNAL(ruleFired(int, int)));
+    connect(worker, SIGNAL(ruleForward(qrc::RuleAction)),  this, SIGNAL(ruleForward(qrc::RuleAction)));
 
     pImpl->thread.start();
-
-    return true;
 }
 
 void Device::close()
@@ -156,11 +826,81 @@ void Device::close()
     }
 }
 
-void Device::request(int address, int command, const QByteArray& data)
+int Device::drain()
+{
+    enum { BATCH = 32 };
+    BusQueue& queue = *pImpl->records;
+    // Сбросить до чтения: всё, что добавится после, разбудит снова
+    queue.signalled.store(false);
+
+    int total = 0;
+    BusRecord batch[BATCH];
+    while (int count = queue.ring.popBatch(batch, BATCH))
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            const BusRecord& record = batch[i];
+            if (record.kind == BusRecord::RECORD_STATE)
+                emit snapshot(record.state);
+            else
+                emit reply(record.address, record.command,
+                           QByteArray(reinterpret_cast<const char*>(record.data), record.size));
+        }
+        total += count;
+    }
+    return total;
+}
+
+void Device::request(int address, int command, const QByteArray& data, int priority, int maxAge)
+{
+    if(!pImpl->thread.isRunning())
+    {
+        emit error(QString(tr("Порт не открыт")));
+    }
+    emit requestWorker(address, command, data, priority, maxAge);
+}
+
+void Device::cancel(int address, int command)
+{
+    emit cancelWorker(address, command);
+}
+
+void Device::setQueueLimit(int priority, int depth, int maxAge)
+{
+    emit queueLimitWorker(priority, depth, maxAge);
+}
+
+void Device::setBaudRate(int address, int baudrate)
 {
     if(!pImpl->thread.isRunning())
     {
         emit error(QString(tr("Порт не открыт")));
+        return;
     }
-    emit requestWorker(address, command, data);
+    emit baudRateWorker(address, baudrate);
+}
+
+void Device::setPolling(int address, int interval, int command)
+{
+    emit pollingWorker(address, interval, command);
+}
+
+void Device::setPollBudget(int pollsPerSecond)
+{
+    emit pollBudgetWorker(pollsPerSecond);
+}
+
+void Device::scan()
+{
+    emit scanWorker();
+}
+
+void Device::setRules(const qrc::RuleTable& table)
+{
+    emit rulesWorker(table);
+}
+
+void Device::runRuleAction(const qrc::RuleAction& action)
+{
+    emit ruleActionWorker(action);
 }
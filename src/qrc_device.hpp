@@ -13,20 +13,128 @@
 // QSerialPort should be installed additionaly, as it decribed here:
 // http://wiki.qt.io/QtSerialPort
 
-#include <QSerialPort>
 #include <QSerialPortInfo>
+#include <QElapsedTimer>
 #include <QObject>
 #include <QScopedPointer>
+#include <QSharedPointer>
+#include <QTimer>
 
+#include "qrc_ledencoder.hpp"
+#include "qrc_poller.hpp"
+#include "qrc_protocol.hpp"
+#include "qrc_ring.hpp"
+#include "qrc_rules.hpp"
+#include "qrc_scheduler.hpp"
+#include "qrc_state.hpp"
+#include "qrc_timing.hpp"
+#include "qrc_transport.hpp"
+
+// Ответ платы, переданный из потока шины через кольцо, а не сигналом
+struct BusRecord
+{
+    enum Kind
+    {
+        RECORD_REPLY, // ответ с данными до MAX_DATA байт
+        RECORD_STATE, // разобранный ответ на CMD_GET_STATE
+    };
+    enum {
+        MAX_DATA = 32,
+    };
+
+    Kind kind;
+    int address;
+    int command;
+    int size;
+    unsigned char data[MAX_DATA];
+    qrc::StateSnapshot state;
+};
+
+// Записи от SerialWorker к Device: писатель - поток шины, читатель - поток Device.
+// Читателя будит один сигнал на пачку: signalled взводит писатель, сбрасывает читатель перед чтением.
+struct BusQueue
+{
+    enum {
+        SIZE = 256,
+    };
+    qrc::SpscRing<BusRecord, SIZE> ring;
+    std::atomic<bool> signalled {false};
+};
+
+// Обработчик порта. Живёт в отдельном потоке и ни на чём не блокируется:
+// запросы складываются в очереди планировщика по приоритетам, а обмен ведётся
+// конечным автоматом по сигналам readyRead/bytesWritten и таймеру ожидания ответа.
 class SerialWorker : public QObject
 {
     Q_OBJECT
 
-    QSerialPortInfo info;
+    enum State
+    {
+        STATE_IDLE,    // ничего не передаём, ждём запросов
+        STATE_WRITING, // пакет отправлен в порт, ждём пока он уйдёт в линию
+        STATE_READING, // ждём ответа от платы
+        STATE_DRAINING, // смена скорости отдана порту, ждём пока она уйдёт в линию
+    };
+
+    QScopedPointer<qrc::Transport> transport; // порт, сокет моста или подставленное устройство
+    QSharedPointer<BusQueue> records; // куда складывать ответы, пусто - только сигналами
+    int bus; // номер шины, уходит в старшие биты адресов узлов
+    QIODevice* port {0}; // устройство транспорта, пока он открыт
+    QTimer timer; // таймаут текущей транзакции
+    QTimer pollTimer; // когда опрашивать следующую плату
+    QTimer reconnectTimer; // следующая попытка восстановить оборванную связь
+    QElapsedTimer clock; // монотонное время для возраста запросов
 
-    QScopedPointer<QSerialPort> serial;
+    State state {STATE_IDLE};
+    qrc::Scheduler scheduler;  // ожидающие отправки запросы
+    qrc::Transaction current;  // запрос, ответа на который ждём
+    qint64 pendingBytes {0};   // сколько байт текущего запроса ещё не ушло в линию
+    qint64 staleBytes {0};     // байты прошлых запросов, об уходе которых порт ещё не сообщил
+    qint64 sentAt {0};         // момент отправки текущего запроса, мс
+    int sentBytes {0};         // размер текущего запроса на линии
+    qrc::RttEstimator rtt[16][qrc::PRIORITY_COUNT]; // время реакции плат по адресам и классам команд
+    qrc::StreamParser parser; // принятые байты
+    QByteArray writeBuffer; // кодированный запрос, растёт до самого длинного пакета
+    qrc::SmartLedEncoder smartLeds[16]; // что отправлено на умные светодиоды по адресам
+    int portBaudRate;    // индекс BAUDRATE_* текущей скорости порта
+    int pendingBaudRate; // индекс скорости, на которую переходим
+    bool baudSwitching {false}; // идёт смена скорости линии
+    int baudVerifyPending {0};  // сколько плат ещё не проверено на новой скорости
+    bool baudVerifyFailed {false};
+    int knownBoards {0}; // платы, отвечавшие на этой шине, бит на адрес
+    qrc::Poller poller;  // опрос плат шины по кругу
+    int scanPending {0}; // сколько адресов поиска плат ещё не ответило или не вышло по таймауту
+    int scanFound {0};   // найденные платы, бит на адрес
+    qrc::RuleEngine rules;    // правила квеста, выполняются прямо по ответам опроса
+    QVector<int> firedRules;  // сработавшие условия последнего снимка
+    // Что отправлено на реле по адресам, от этого считают правила. Плата о своих реле
+    // не сообщает: до первой записи CMD_SET_RELAY (своей или из правила) считается,
+    // что они выключены, как после включения платы.
+    unsigned char relays[16];
+    int relaysKnown {0}; // платы, реле которых уже задавались, бит на адрес
+
+    // Открыть транспорт, если ещё не открыт. Device зовёт из своего потока при открытии шины.
+    Q_INVOKABLE bool openPort();
+    bool accepting();
+    void startNext();
+    void finish();
+    void parseInput();
+    void enqueue(int address, int command, const QByteArray& data, int priority, int tag = 0, int timeout = 0, int maxAge = 0);
+    void scanDone(const qrc::Transaction& transaction, bool found);
+    void completed(const qrc::Transaction& transaction, int replyCommand);
+    bool setPortBaudRate(int baudrate);
+    void baudVerified(bool ok);
+    void reportDropped(const QList<qrc::Transaction>& stale);
+    void forgetLeds(const qrc::Transaction& transaction);
+    qrc::RttEstimator& rttFor(int address, int command);
+    bool post(const BusRecord& record);
+    void runRules(const qrc::StateSnapshot& input);
+    void enqueueAction(const qrc::RuleAction& action);
 public:
-    SerialWorker(const QSerialPortInfo& info, QObject *parent = 0);
+    // Worker становится владельцем транспорта
+    SerialWorker(qrc::Transport* transport, int bus = 0, QObject *parent = 0);
+    // Ответы и состояния - через очередь records, сигналами - только если она переполнена
+    void setRecordQueue(const QSharedPointer<BusQueue>& queue);
     ~SerialWorker();
 
 signals:
@@ -34,10 +142,33 @@ signals:
     void parse_error(int error, const QByteArray& data); // ошибка разбора
     void reply_silent(int address, int command); // типа ответ от команд которые не возвращают ответа (при посылке на адреса 0x00, 0x0F)
     void reply(int address, int command, const QByteArray& data); // ответ на команду
+    void snapshot(const qrc::StateSnapshot& state); // ответ на CMD_GET_STATE, уже разобранный
     void timeout(int address, int command, const QByteArray& data); // ответа не дождались
+    void dropped(int address, int command, const QByteArray& data); // запрос выброшен из очереди не отправленным
+    void baudRateChanged(int bus, int baudrate); // порт перешёл на скорость с индексом BAUDRATE_*
+    void scanFinished(int bus, int boards); // поиск плат закончен, бит на каждый ответивший адрес
+    void recordsReady(); // в очереди записей появились записи, будит читателя один раз на пачку
+    void ruleFired(int address, int line); // сработало правило из строки line файла правил
+    void ruleForward(const qrc::RuleAction& action); // действие правила для узла другой шины
 
 public slots:
-    void request(int address, int command, const QByteArray& data);
+    void request(int address, int command, const QByteArray& data, int priority = qrc::PRIORITY_DEFAULT, int maxAge = 0);
+    void cancel(int address, int command);
+    void setQueueLimit(int priority, int depth, int maxAge);
+    void setBaudRate(int address, int baudrate);
+    void setPolling(int address, int interval, int command);
+    void setPollBudget(int pollsPerSecond);
+    void scan();
+    void setRules(const qrc::RuleTable& table);
+    void runRuleAction(const qrc::RuleAction& action); // действие, сработавшее на другой шине
+
+private slots:
+    void pollTick();
+    void readyRead();
+    void bytesWritten(qint64 bytes);
+    void timerExpired();
+    void portDisconnected();
+    void reconnect();
 };
 
 class Device : public QObject
@@ -46,22 +177,72 @@ class Device : public QObject
 
     struct Impl;
     QScopedPointer<Impl> pImpl;
+
+    void start(SerialWorker* worker);
 public:
     explicit Device(QObject *parent = 0);
     ~Device();
 
-    bool open(const QSerialPortInfo& info);
+    // Адреса в запросах и сигналах - адреса узлов (см. qrc::nodeAddress) шины bus
+    bool open(const QSerialPortInfo& info, int bus = 0);
+    // Вместо порта - любое устройство с тем же протоколом (например qrc::SimulatorDevice).
+    // Устройство переходит в поток обмена и удаляется вместе с ним.
+    bool open(QIODevice* device, int bus = 0);
+    // Любой транспорт (см. qrc::createTransport), Device становится его владельцем.
+    // Транспорт открывается до возврата: false - порт занят или нет связи (причина - сигналом error).
+    // Оборванная связь с мостом восстанавливается сама, запросы при этом ждут в очереди.
+    bool open(qrc::Transport* transport, int bus = 0);
     void close();
+
 signals:
     void error(const QString& message);
     void parse_error(int error, const QByteArray& data); // ошибка разбора
     void reply_silent(int address, int command); // типа ответ от команд которые не возвращают ответа (при посылке на адреса 0x00, 0x0F)
     void reply(int address, int command, const QByteArray& data);
+    void snapshot(const qrc::StateSnapshot& state); // ответ на CMD_GET_STATE
     void timeout(int address, int command, const QByteArray& data); // ответа не дождались
+    void dropped(int address, int command, const QByteArray& data); // запрос выброшен из очереди не отправленным
+    void baudRateChanged(int bus, int baudrate); // порт перешёл на скорость с индексом BAUDRATE_*
+    void scanFinished(int bus, int boards); // поиск плат закончен, бит на каждый ответивший адрес
+    void ruleFired(int address, int line); // сработало правило из строки line файла правил
+    void ruleForward(const qrc::RuleAction& action); // действие правила для узла другой шины
 
-    void requestWorker(int address, int command, const QByteArray& data);
+    void requestWorker(int address, int command, const QByteArray& data, int priority, int maxAge);
+    void cancelWorker(int address, int command);
+    void queueLimitWorker(int priority, int depth, int maxAge);
+    void baudRateWorker(int address, int baudrate);
+    void pollingWorker(int address, int interval, int command);
+    void pollBudgetWorker(int pollsPerSecond);
+    void scanWorker();
+    void rulesWorker(const qrc::RuleTable& table);
+    void ruleActionWorker(const qrc::RuleAction& action);
 public slots:
-    void request(int address, int command, const QByteArray& data);
+    // Разослать накопленные потоком шины ответы сигналами reply/snapshot. Зовётся сама
+    // по сигналу потока шины, но можно и вручную по своему расписанию. Возвращает число записей.
+    int drain();
+
+    // maxAge - предельный возраст именно этого запроса в очереди, мс (0 - как у класса):
+    // не отправленный за это время запрос выбрасывается, не трогая очередь остальных
+    void request(int address, int command, const QByteArray& data, int priority = qrc::PRIORITY_DEFAULT, int maxAge = 0);
+    // Отменить ещё не отправленные запросы на адрес (command < 0 - все команды)
+    void cancel(int address, int command = -1);
+    // Глубина очереди класса приоритета и предельный возраст запроса в мс (0 - без ограничения).
+    // Очередь PRIORITY_OUTPUT не ограничивается: реле не теряются
+    void setQueueLimit(int priority, int depth, int maxAge = 0);
+    // Перевести всю шину и порт на скорость с индексом BAUDRATE_*: скорость у линии одна,
+    // так что плата в адресе не важна. Широковещательная команда, порт переключается,
+    // когда она уйдёт в линию, затем каждая уже отвечавшая плата проверяется CMD_HELLO.
+    // Если хоть одна промолчит - все возвращаются на 9600. Итог - сигнал baudRateChanged.
+    void setBaudRate(int address, int baudrate);
+    // Опрашивать плату раз в interval мс командой command (interval <= 0 - перестать)
+    void setPolling(int address, int interval, int command = qrc::CMD_GET_STATE);
+    // Предел опросов в секунду на шину, 0 - без ограничения
+    void setPollBudget(int pollsPerSecond);
+    // Найти платы на шине: CMD_HELLO на адреса 1-14 с коротким таймаутом
+    void scan();
+    // Правила квеста выполняются в потоке шины по каждому ответу CMD_GET_STATE
+    void setRules(const qrc::RuleTable& table);
+    void runRuleAction(const qrc::RuleAction& action);
 };
 
 #endif // DEVICE_H
@@ -0,0 +1,106 @@
+/******************************************************************************
+ *
+ * Quest Room Control
+ *
+ * Gamma and brightness correction of smart LEDs with temporal dithering
+ *
+ * (c) Roman A. Bulygin 2016
+ *
+ ******************************************************************************/
+
+#include "qrc_gamma.hpp"
+
+#include <math.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define QRC_GAMMA_SSE2 1 // на x86-64 SSE2 есть всегда
+#include <emmintrin.h>
+#endif
+
+namespace qrc {
+
+enum {
+    MAX_VALUE = LedGamma::LEVELS - 1,
+    ROUND = 1 << (LedGamma::FRACTION_BITS - 1),
+    FRACTION_MASK = (1 << LedGamma::FRACTION_BITS) - 1,
+    BLOCK = 96, // каналов за проход через таблицу, ровно кадр платы
+};
+
+LedGamma::LedGamma(double gamma, int brightness)
+    : mGamma(gamma)
+    , mBrightness(qBound(0, brightness, int(MAX_BRIGHTNESS)))
+{
+    rebuild();
+}
+
+void LedGamma::setGamma(double gamma)
+{
+    mGamma = gamma;
+    rebuild();
+}
+
+void LedGamma::setBrightness(int brightness)
+{
+    mBrightness = qBound(0, brightness, int(MAX_BRIGHTNESS));
+    rebuild();
+}
+
+void LedGamma::rebuild()
+{
+    double gamma = (mGamma > 0) ? mGamma : 1.0;
+    double scale = double(MAX_VALUE << FRACTION_BITS) * mBrightness / MAX_BRIGHTNESS;
+    for (int i = 0; i < LEVELS; ++i)
+        mTable[i] = quint16(pow(double(i) / MAX_VALUE, gamma) * scale + 0.5);
+}
+
+int LedGamma::map(int value) const
+{
+    return (mTable[qBound(0, value, int(MAX_VALUE))] + ROUND) >> FRACTION_BITS;
+}
+
+// acc = table + residual; out = acc >> FRACTION_BITS; residual = acc & FRACTION_MASK.
+// Без дизеринга residual - постоянная половина младшего разряда, то есть округление.
+// Переполнения нет: table <= 4095 << 4, residual <= 15.
+static void dither(const quint16* mapped, quint16* out, int count, quint16* residual)
+{
+    int i = 0;
+#ifdef QRC_GAMMA_SSE2
+    const __m128i mask = _mm_set1_epi16(FRACTION_MASK);
+    const __m128i round = _mm_set1_epi16(ROUND);
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i acc = _mm_loadu_si128(reinterpret_cast<const __m128i*>(mapped + i));
+        if (residual != 0)
+        {
+            acc = _mm_add_epi16(acc, _mm_loadu_si128(reinterpret_cast<const __m128i*>(residual + i)));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(residual + i), _mm_and_si128(acc, mask));
+        }
+        else
+            acc = _mm_add_epi16(acc, round);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_srli_epi16(acc, LedGamma::FRACTION_BITS));
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        int acc = mapped[i] + ((residual != 0) ? residual[i] : int(ROUND));
+        if (residual != 0)
+            residual[i] = quint16(acc & FRACTION_MASK);
+        out[i] = quint16(acc >> LedGamma::FRACTION_BITS);
+    }
+}
+
+void LedGamma::apply(const quint16* in, quint16* out, int count, quint16* residual) const
+{
+    quint16 mapped[BLOCK];
+    for (int done = 0; done < count; done += BLOCK)
+    {
+        int n = qMin(int(BLOCK), count - done);
+        // Перелёт интерполяции за 4095 - полная яркость, а не погасший по маске канал.
+        // Дальше (и в SSE2) идут только значения из таблицы.
+        for (int i = 0; i < n; ++i)
+            mapped[i] = mTable[qMin(int(in[done + i]), int(MAX_VALUE))];
+        dither(mapped, out + done, n, (residual != 0) ? residual + done : 0);
+    }
+}
+
+} // namespace qrc
@@ -0,0 +1,62 @@
+/******************************************************************************
+ *
+ * Quest Room Control
+ *
+ * Gamma and brightness correction of smart LEDs with temporal dithering
+ *
+ * (c) Roman A. Bulygin 2016
+ *
+ ******************************************************************************/
+
+#pragma once
+
+#ifndef _QRC_GAMMA_HPP_
+#define _QRC_GAMMA_HPP_
+
+#include <QtGlobal>
+
+#include "qrc_protocol.hpp"
+
+namespace qrc {
+
+// Перевод воспринимаемой яркости (12 бит) в значение для драйвера (12 бит)
+// по таблице на все 4096 значений: степень gamma и общая яркость.
+// В таблице 4 лишних дробных бита: без дизеринга они округляются,
+// с дизерингом копятся между кадрами в residual и раз в несколько кадров
+// добавляют единицу, так что тёмные плавные переходы не идут ступеньками.
+class LedGamma
+{
+public:
+    enum {
+        FRACTION_BITS = 4,
+        LEVELS = 4096,
+        MAX_BRIGHTNESS = 255,
+    };
+
+    explicit LedGamma(double gamma = 2.2, int brightness = MAX_BRIGHTNESS);
+
+    void setGamma(double gamma); // 1.0 - без коррекции
+    void setBrightness(int brightness); // 0 - MAX_BRIGHTNESS
+    double gamma() const { return mGamma; }
+    int brightness() const { return mBrightness; }
+
+    // Одно значение с округлением
+    int map(int value) const;
+
+    // Кадр из count каналов: in -> out (можно на месте). residual - по значению
+    // на канал, живёт между кадрами одной платы (сначала нули); 0 - без дизеринга.
+    // Значения in больше 4095 считаются равными 4095.
+    // Подстановка по таблице поканальная, остальное - по 8 каналов за раз (SSE2).
+    void apply(const quint16* in, quint16* out, int count, quint16* residual = 0) const;
+
+private:
+    void rebuild();
+
+    quint16 mTable[LEVELS]; // значение << FRACTION_BITS
+    double mGamma;
+    int mBrightness;
+};
+
+} // namespace qrc
+
+#endif // _QRC_GAMMA_HPP_
@@ -0,0 +1,244 @@
+/******************************************************************************
+ *
+ * Quest Room Control
+ *
+ * Minimal-bytes encoder of smart LED updates
+ *
+ * (c) Roman A. Bulygin 2016
+ *
+ ******************************************************************************/
+#include "qrc_ledencoder.hpp"
+
+using namespace qrc;
+
+enum {
+    CHANNELS_PER_LED = 3,
+    LEDS_TOTAL = QRC_XLED_COUNT / CHANNELS_PER_LED, // 32 RGB светодиода
+    LEDS_PER_DRIVER = 8,
+    LEDS_PER_HALF = 4,
+    DRIVERS = LEDS_TOTAL / LEDS_PER_DRIVER,
+    HALVES_PER_DRIVER = LEDS_PER_DRIVER / LEDS_PER_HALF,
+    FRAME_BYTES = QRC_XLED_COUNT * 12 / 8,               // 144
+    DRIVER_BYTES = LEDS_PER_DRIVER * CHANNELS_PER_LED * 12 / 8, // 36
+    HALF_BYTES = LEDS_PER_HALF * CHANNELS_PER_LED * 12 / 8,     // 18
+    SINGLE_BYTES = 1 + CHANNELS_PER_LED * 2,
+};
+
+// Байт на линии за одну команду: пакет запроса и квитанция
+static inline int wireCost(int dataSize)
+{
+    return packetSize(dataSize) + packetSize(0);
+}
+
+// Светодиоды в кадре идут задом наперёд: последний светодиод в начале кадра.
+// Поэтому драйвер n (светодиоды 8n..8n+7) лежит одним куском с конца кадра.
+static inline int driverOffset(int driver)
+{
+    return FRAME_BYTES - (driver+1)*DRIVER_BYTES;
+}
+
+static inline int halfOffset(int half)
+{
+    return FRAME_BYTES - (half+1)*HALF_BYTES;
+}
+
+static inline bool ledDiffers(const LedRgb* a, const LedRgb* b, int led)
+{
+    return (a[led].r != b[led].r) || (a[led].g != b[led].g) || (a[led].b != b[led].b);
+}
+
+static inline LedCommand makeCommand(int command, int index, const QByteArray& payload)
+{
+    LedCommand result;
+    result.command = command;
+    result.data.reserve(payload.size()+1);
+    result.data.append(char(index)).append(payload);
+    return result;
+}
+
+static inline LedCommand makeSingle(const XLedHelper& leds, int led)
+{
+    LedCommand result;
+    result.command = SET_SPECIFIC_SMART_LED;
+    result.data.reserve(SINGLE_BYTES);
+    result.data.append(char(led));
+    for (int c = 0; c < CHANNELS_PER_LED; ++c)
+    {
+        int value = leds.get(led*CHANNELS_PER_LED+c);
+        result.data.append(char((value >> 8) & 0x0F)).append(char(value & 0xFF));
+    }
+    return result;
+}
+
+SmartLedEncoder::SmartLedEncoder()
+{}
+
+QList<LedCommand> SmartLedEncoder::encode(const QByteArray& leds)
+{
+    QList<LedCommand> result;
+
+    XLedHelper next;
+    if (!next.setData(leds))
+    {
+        // Кадр нестандартного размера - отдаём как есть, что на плате - неизвестно
+        LedCommand full = {CMD_SET_SMART_LEDS, leds};
+        result.append(full);
+        mValid = false;
+        return result;
+    }
+
+    if (!mValid)
+    {
+        LedCommand full = {CMD_SET_SMART_LEDS, leds};
+        result.append(full);
+        mSent = next;
+        mValid = true;
+        return result;
+    }
+
+    // Выбираем снизу вверх: одиночные -> половина драйвера -> драйвер -> полный кадр
+    // Оба кадра распаковываются целиком за проход, а не по каналу
+    LedRgb sent[LEDS_TOTAL];
+    LedRgb wanted[LEDS_TOTAL];
+    mSent.getGroups(0, sent, LEDS_TOTAL);
+    next.getGroups(0, wanted, LEDS_TOTAL);
+    bool changed[LEDS_TOTAL];
+    for (int led = 0; led < LEDS_TOTAL; ++led)
+        changed[led] = ledDiffers(sent, wanted, led);
+
+    enum { USE_NONE, USE_SINGLES, USE_HALF, USE_DRIVER };
+    int halfChoice[DRIVERS*HALVES_PER_DRIVER];
+    int driverChoice[DRIVERS];
+    int totalCost = 0;
+    for (int driver = 0; driver < DRIVERS; ++driver)
+    {
+        int halvesCost = 0;
+        for (int h = 0; h < HALVES_PER_DRIVER; ++h)
+        {
+            int half = driver*HALVES_PER_DRIVER + h;
+            int count = 0;
+            for (int led = half*LEDS_PER_HALF; led < (half+1)*LEDS_PER_HALF; ++led)
+                count += changed[led] ? 1 : 0;
+
+            int singlesCost = count * wireCost(SINGLE_BYTES);
+            int halfCost = wireCost(1 + HALF_BYTES);
+            if (count == 0)
+                halfChoice[half] = USE_NONE;
+            else
+                halfChoice[half] = (singlesCost <= halfCost) ? USE_SINGLES : USE_HALF;
+            halvesCost += (count == 0) ? 0 : qMin(singlesCost, halfCost);
+        }
+        int driverCost = wireCost(1 + DRIVER_BYTES);
+        if (halvesCost == 0)
+            driverChoice[driver] = USE_NONE;
+        else
+            driverChoice[driver] = (halvesCost <= driverCost) ? USE_HALF : USE_DRIVER;
+        totalCost += qMin(halvesCost, driverCost);
+    }
+
+    if (totalCost == 0)
+        return result; // ничего не поменялось
+
+    if (wireCost(FRAME_BYTES) <= totalCost)
+    {
+        LedCommand full = {CMD_SET_SMART_LEDS, leds};
+        result.append(full);
+    }
+    else
+    {
+        for (int driver = 0; driver < DRIVERS; ++driver)
+        {
+            if (driverChoice[driver] == USE_DRIVER)
+            {
+                result.append(makeCommand(SET_SPECIFIC_SMART_LEDS_8, driver, leds.mid(driverOffset(driver), DRIVER_BYTES)));
+                continue;
+            }
+            if (driverChoice[driver] == USE_NONE)
+                continue;
+            for (int h = 0; h < HALVES_PER_DRIVER; ++h)
+            {
+                int half = driver*HALVES_PER_DRIVER + h;
+                if (halfChoice[half] == USE_HALF)
+                {
+                    result.append(makeCommand(SET_SPECIFIC_SMART_LEDS_4, half, leds.mid(halfOffset(half), HALF_BYTES)));
+                }
+                else if (halfChoice[half] == USE_SINGLES)
+                {
+                    for (int led = half*LEDS_PER_HALF; led < (half+1)*LEDS_PER_HALF; ++led)
+                        if (changed[led])
+                            result.append(makeSingle(next, led));
+                }
+            }
+        }
+    }
+
+    mSent = next;
+    return result;
+}
+
+void SmartLedEncoder::apply(int command, const QByteArray& data)
+{
+    if (command == CMD_SET_SMART_LEDS)
+    {
+        mValid = mSent.setData(data);
+        return;
+    }
+    if (!mValid)
+        return;
+    if (data.isEmpty())
+    {
+        mValid = false;
+        return;
+    }
+
+    int index = (unsigned char)data[0];
+    QByteArray frame = mSent.data();
+    switch (command)
+    {
+    case SET_SPECIFIC_SMART_LEDS_8:
+        if ((index < DRIVERS) && (data.size() == DRIVER_BYTES+1))
+        {
+            frame.replace(driverOffset(index), DRIVER_BYTES, data.mid(1));
+            mSent.setData(frame);
+            return;
+        }
+        break;
+    case SET_SPECIFIC_SMART_LEDS_4:
+        if ((index < DRIVERS*HALVES_PER_DRIVER) && (data.size() == HALF_BYTES+1))
+        {
+            frame.replace(halfOffset(index), HALF_BYTES, data.mid(1));
+            mSent.setData(frame);
+            return;
+        }
+        break;
+    case SET_SPECIFIC_SMART_LED:
+        if ((index < LEDS_TOTAL) && (data.size() == SINGLE_BYTES))
+        {
+            for (int c = 0; c < CHANNELS_PER_LED; ++c)
+            {
+                int value = (((unsigned char)data[1+c*2] & 0x0F) << 8) | (unsigned char)data[2+c*2];
+                mSent.set(index*CHANNELS_PER_LED+c, value);
+            }
+            return;
+        }
+        break;
+    default:
+        return;
+    }
+    mValid = false; // непонятная команда - не знаем, что стало на плате
+}
+
+void SmartLedEncoder::invalidate()
+{
+    mValid = false;
+}
+
+bool SmartLedEncoder::isValid() const
+{
+    return mValid;
+}
+
+const XLedHelper& SmartLedEncoder::state() const
+{
+    return mSent;
+}
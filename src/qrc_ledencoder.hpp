@@ -0,0 +1,53 @@
+/******************************************************************************
+ *
+ * Quest Room Control
+ *
+ * Minimal-bytes encoder of smart LED updates
+ *
+ * (c) Roman A. Bulygin 2016
+ *
+ ******************************************************************************/
+
+#pragma once
+
+#ifndef _QRC_LEDENCODER_HPP_
+#define _QRC_LEDENCODER_HPP_
+
+#include <QByteArray>
+#include <QList>
+
+#include "qrc_protocol.hpp"
+
+namespace qrc {
+
+struct LedCommand
+{
+    int command;
+    QByteArray data;
+};
+
+// Помнит, что уже отправлено на плату, и переводит новый кадр умных светодиодов
+// в набор команд CMD_SET_SMART_LEDS, SET_SPECIFIC_SMART_LEDS_8, SET_SPECIFIC_SMART_LEDS_4
+// и SET_SPECIFIC_SMART_LED с наименьшим числом байт на линии (с учётом ответа-квитанции).
+class SmartLedEncoder
+{
+    XLedHelper mSent;
+    bool mValid {false}; // состояние платы известно
+public:
+    SmartLedEncoder();
+
+    // Команды для перехода к кадру leds (полный кадр CMD_SET_SMART_LEDS).
+    // Пока состояние платы неизвестно, отдаёт полный кадр.
+    QList<LedCommand> encode(const QByteArray& leds);
+    // Учесть команду, отправленную на плату в обход encode
+    void apply(int command, const QByteArray& data);
+    // Состояние платы неизвестно (ошибка, таймаут, выброшенный запрос)
+    void invalidate();
+
+    bool isValid() const;
+    const XLedHelper& state() const;
+};
+
+} // namespace qrc
+
+#endif // _QRC_LEDENCODER_HPP_
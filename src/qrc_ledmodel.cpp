@@ -57,7 +57,11 @@ static inline QString groupName(const QModelIndex & index)
 QrcLedModel::QrcLedModel(QObject * parent)
     : QAbstractTableModel(parent)
     , leds(LEDS_TOTAL)
-{}
+    , batch(this)
+{
+    connect(&batch, SIGNAL(cellsChanged(int, int, int, int)), SLOT(cellsChanged(int, int, int, int)));
+    connect(&batch, SIGNAL(frame()), SLOT(flushLeds()));
+}
 
 QrcLedModel::~QrcLedModel()
 {}
@@ -154,11 +158,29 @@ QrcLedModel::setData(const QModelIndex & idx, const QVariant & value, int role)
         return false;
 
     int ledIdx = ledIndex(idx);
-    if(ledIdx < LEDS_TOTAL)
+    if((ledIdx < LEDS_TOTAL) && (leds.get(ledIdx) != value.toBool()))
     {
         leds.set(ledIdx, value.toBool());
-        emit dataChanged(index(idx.row(), idx.column()), index(idx.row(), idx.column()));
-        emit ledsChanged(leds.data());
+        batch.cellChanged(idx.row(), idx.column());
+        batch.changed();
     }
     return true;
 }
+
+void
+QrcLedModel::cellsChanged(int top, int left, int bottom, int right)
+{
+    emit dataChanged(index(top, left), index(bottom, right));
+}
+
+void
+QrcLedModel::flushLeds()
+{
+    // Переключенный туда и обратно за кадр светодиод не стоит посылки
+    QByteArray data = leds.data();
+    if (data != sent)
+    {
+        sent = data;
+        emit ledsChanged(sent);
+    }
+}
@@ -13,12 +13,15 @@
 #include <QAbstractTableModel>
 #include <QVector>
 
+#include "qrc_batch.hpp"
 #include "qrc_protocol.hpp"
 
 class QrcLedModel : public QAbstractTableModel
 {
 Q_OBJECT
     qrc::LedHelper leds;
+    QByteArray sent; // последнее отправленное ledsChanged
+    qrc::ChangeBatch batch;
 public:
     QrcLedModel(QObject * parent = 0);
     ~QrcLedModel();
@@ -30,6 +33,21 @@ public:
     QVariant data(const QModelIndex & index, int role = Qt::DisplayRole) const;
     bool setData(const QModelIndex & idx, const QVariant & value, int role);
 
+    // Пакет изменений: между beginBatch() и endBatch() setData не шлёт сигналов,
+    // по endBatch() - один dataChanged на охватывающий прямоугольник и один ledsChanged.
+    // Пакеты могут быть вложенными.
+    void beginBatch() { batch.begin(); }
+    void endBatch() { batch.end(); }
+
+    // ledsChanged не чаще fps раз в секунду, последнее состояние не теряется.
+    // 0 - сразу после каждого изменения.
+    void setFrameRate(int fps) { batch.setFrameRate(fps); }
+    int getFrameRate() const { return batch.frameRate(); }
+
+private slots:
+    void cellsChanged(int top, int left, int bottom, int right);
+    void flushLeds();
+
 signals:
     void ledsChanged(const QByteArray& leds);
 };
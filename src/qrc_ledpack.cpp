@@ -0,0 +1,214 @@
+/******************************************************************************
+ *
+ * Quest Room Control
+ *
+ * Bulk packing of 12-bit smart LED channels
+ *
+ * (c) Roman A. Bulygin 2016
+ *
+ ******************************************************************************/
+
+#include "qrc_ledpack.hpp"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define QRC_PACK_SSSE3 1
+#include <immintrin.h>
+#endif
+
+namespace qrc {
+
+// Позиция канала в данных: pos-й 12-битный отрезок, pos = size - channel - 1.
+// Два соседних отрезка (чётный pos и следующий) занимают ровно 3 байта с pos*3/2.
+
+static inline int getNibbles(const unsigned char* data, int pos)
+{
+    int byte = pos*3/2;
+    int value = (data[byte] << 8) | data[byte+1];
+    return ((pos & 1) ? value : (value >> 4)) & 0xFFF;
+}
+
+static inline void setNibbles(unsigned char* data, int pos, int value)
+{
+    int byte = pos*3/2;
+    if (pos & 1) // не c начала байта
+    {
+        data[byte] = (unsigned char)((data[byte] & 0xF0) | ((value >> 8) & 0x0F));
+        data[byte+1] = (unsigned char)value;
+    }
+    else // с начала байта
+    {
+        data[byte] = (unsigned char)(value >> 4);
+        data[byte+1] = (unsigned char)((data[byte+1] & 0x0F) | ((value << 4) & 0xF0));
+    }
+}
+
+/******************************************************************************
+ * Без SIMD: по парам каналов, целыми байтами
+ ******************************************************************************/
+
+// Отрезки [pos, end) чётной длины с чётного pos; channel(pos) = channels[last - pos]
+static void packPairsScalar(const unsigned short* channels, int last, unsigned char* data, int pos, int end)
+{
+    for (; pos < end; pos += 2)
+    {
+        int a = channels[last - pos] & 0xFFF;
+        int b = channels[last - pos - 1] & 0xFFF;
+        unsigned char* out = data + pos*3/2;
+        out[0] = (unsigned char)(a >> 4);
+        out[1] = (unsigned char)((a << 4) | (b >> 8));
+        out[2] = (unsigned char)b;
+    }
+}
+
+static void unpackPairsScalar(const unsigned char* data, unsigned short* channels, int last, int pos, int end)
+{
+    for (; pos < end; pos += 2)
+    {
+        const unsigned char* in = data + pos*3/2;
+        channels[last - pos] = (unsigned short)((in[0] << 4) | (in[1] >> 4));
+        channels[last - pos - 1] = (unsigned short)(((in[1] & 0x0F) << 8) | in[2]);
+    }
+}
+
+#ifdef QRC_PACK_SSSE3
+
+/******************************************************************************
+ * SSSE3: 8 каналов <-> 12 байт
+ ******************************************************************************/
+
+// Слова в обратном порядке
+#define REVERSE_WORDS 14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1
+
+__attribute__((target("ssse3")))
+static void packPairsSsse3(const unsigned short* channels, int last, unsigned char* data, int pos, int end)
+{
+    const __m128i reverse = _mm_setr_epi8(REVERSE_WORDS);
+    // Из каждого 32-битного t = a << 12 | b байты 2, 1, 0 подряд
+    const __m128i bytes = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m128i low = _mm_set1_epi32(0xFFFF);
+    const __m128i mask = _mm_set1_epi16(0x0FFF);
+    for (; pos + 8 <= end; pos += 8)
+    {
+        // channels[last - pos - 7 .. last - pos] -> отрезки pos .. pos + 7
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(channels + last - pos - 7));
+        x = _mm_and_si128(_mm_shuffle_epi8(x, reverse), mask);
+        __m128i t = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(x, low), 12), _mm_srli_epi32(x, 16));
+        t = _mm_shuffle_epi8(t, bytes);
+        // 12 байт, не задевая соседних
+        unsigned char* out = data + pos*3/2;
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(out), t);
+        int tail = _mm_cvtsi128_si32(_mm_srli_si128(t, 8));
+        memcpy(out + 8, &tail, 4);
+    }
+    packPairsScalar(channels, last, data, pos, end);
+}
+
+__attribute__((target("ssse3")))
+static void unpackPairsSsse3(const unsigned char* data, unsigned short* channels, int last, int pos, int end)
+{
+    const __m128i reverse = _mm_setr_epi8(REVERSE_WORDS);
+    // 3 байта пары в 32-битное t = b0 << 16 | b1 << 8 | b2
+    const __m128i bytes = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+    const __m128i mask = _mm_set1_epi32(0x0FFF);
+    for (; pos + 8 <= end; pos += 8)
+    {
+        // 12 байт, не читая за ними
+        const unsigned char* in = data + pos*3/2;
+        int tail;
+        memcpy(&tail, in + 8, 4);
+        __m128i x = _mm_unpacklo_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(in)), _mm_cvtsi32_si128(tail));
+        __m128i t = _mm_shuffle_epi8(x, bytes);
+        // a - в младшее слово, b - в старшее
+        t = _mm_or_si128(_mm_srli_epi32(t, 12), _mm_slli_epi32(_mm_and_si128(t, mask), 16));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(channels + last - pos - 7), _mm_shuffle_epi8(t, reverse));
+    }
+    unpackPairsScalar(data, channels, last, pos, end);
+}
+
+#undef REVERSE_WORDS
+
+#endif // QRC_PACK_SSSE3
+
+/******************************************************************************
+ * Выбор реализации
+ ******************************************************************************/
+
+struct PackFunctions
+{
+    void (*pack)(const unsigned short*, int, unsigned char*, int, int);
+    void (*unpack)(const unsigned char*, unsigned short*, int, int, int);
+    const char* name;
+
+    PackFunctions()
+        : pack(packPairsScalar)
+        , unpack(unpackPairsScalar)
+        , name("scalar")
+    {
+#ifdef QRC_PACK_SSSE3
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("ssse3"))
+        {
+            pack = packPairsSsse3;
+            unpack = unpackPairsSsse3;
+            name = "ssse3";
+        }
+#endif
+    }
+};
+
+static const PackFunctions& packFunctions()
+{
+    static const PackFunctions functions; // потокобезопасно с C++11
+    return functions;
+}
+
+// Диапазон каналов - в диапазон отрезков [pos, end). Нечётные края - по одному отрезку,
+// середина - целыми парами. channel(pos) = channels[last - pos].
+void packLeds12(const unsigned short* channels, unsigned char* data, int size, int first, int count)
+{
+    if (count <= 0)
+        return;
+    int pos = size - first - count;
+    int end = size - first;
+    int last = size - first - 1;
+    if (pos & 1)
+    {
+        setNibbles(data, pos, channels[last - pos]);
+        ++pos;
+    }
+    if ((end - pos) & 1)
+    {
+        --end;
+        setNibbles(data, end, channels[last - end]);
+    }
+    packFunctions().pack(channels, last, data, pos, end);
+}
+
+void unpackLeds12(const unsigned char* data, unsigned short* channels, int size, int first, int count)
+{
+    if (count <= 0)
+        return;
+    int pos = size - first - count;
+    int end = size - first;
+    int last = size - first - 1;
+    if (pos & 1)
+    {
+        channels[last - pos] = (unsigned short)getNibbles(data, pos);
+        ++pos;
+    }
+    if ((end - pos) & 1)
+    {
+        --end;
+        channels[last - end] = (unsigned short)getNibbles(data, end);
+    }
+    packFunctions().unpack(data, channels, last, pos, end);
+}
+
+const char* ledPackImplementation()
+{
+    return packFunctions().name;
+}
+
+} // namespace qrc
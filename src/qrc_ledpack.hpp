@@ -0,0 +1,30 @@
+/******************************************************************************
+ *
+ * Quest Room Control
+ *
+ * Bulk packing of 12-bit smart LED channels
+ *
+ * (c) Roman A. Bulygin 2016
+ *
+ ******************************************************************************/
+
+#pragma once
+
+#ifndef _QRC_LEDPACK_HPP_
+#define _QRC_LEDPACK_HPP_
+
+namespace qrc {
+
+// Данные CMD_SET_SMART_LEDS: каналы по 12 бит подряд, старшими битами вперёд,
+// в обратном порядке (первым идёт последний канал). Каналы [first, first + count)
+// из channels - в data и обратно, для кадра из size каналов. Границы не проверяются.
+// Реализация выбирается при первом вызове: SSSE3 (по 8 каналов за раз) или по парам каналов.
+void packLeds12(const unsigned short* channels, unsigned char* data, int size, int first, int count);
+void unpackLeds12(const unsigned char* data, unsigned short* channels, int size, int first, int count);
+
+// Какая реализация выбрана: "ssse3" или "scalar"
+const char* ledPackImplementation();
+
+} // namespace qrc
+
+#endif // _QRC_LEDPACK_HPP_
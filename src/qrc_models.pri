@@ -0,0 +1,15 @@
+#-------------------------------------------------
+#
+# Table models of LEDs, they need QtGui for colors.
+#
+#-------------------------------------------------
+
+QT += gui
+
+SOURCES += \
+    $$PWD/qrc_ledmodel.cpp \
+    $$PWD/qrc_smartledmodel.cpp
+
+HEADERS += \
+    $$PWD/qrc_ledmodel.hpp \
+    $$PWD/qrc_smartledmodel.hpp
@@ -0,0 +1,147 @@
+/******************************************************************************
+ *
+ * Quest Room Control
+ *
+ * Round-robin polling of boards on a bus
+ *
+ * (c) Roman A. Bulygin 2016
+ *
+ ******************************************************************************/
+#include "qrc_poller.hpp"
+
+using namespace qrc;
+
+enum {
+    FAILURES_TO_SLOW = 3,  // таймаутов подряд до перехода на редкий опрос
+    SLOW_INTERVAL = 2000,  // ms, редкий опрос молчащей платы
+    MIN_INTERVAL = 1,      // ms
+};
+
+Poller::Target* Poller::find(int address)
+{
+    for (auto& target : mTargets)
+        if (target.address == address)
+            return &target;
+    return 0;
+}
+
+int Poller::interval(const Target& target) const
+{
+    return (target.failures >= FAILURES_TO_SLOW) ? qMax(int(SLOW_INTERVAL), target.interval) : target.interval;
+}
+
+void Poller::setTarget(int address, int interval, int command)
+{
+    int board = nodeBoard(address);
+    if ((board == 0) || (board == 15)) // широковещательные не отвечают
+        return;
+
+    for (int i = 0; i < mTargets.size(); ++i)
+    {
+        if (mTargets[i].address != address)
+            continue;
+        if (interval <= 0)
+        {
+            mTargets.removeAt(i);
+            if (mCursor > i)
+                --mCursor;
+            return;
+        }
+        mTargets[i].interval = qMax(int(MIN_INTERVAL), interval);
+        mTargets[i].command = command;
+        mTargets[i].failures = 0;
+        return;
+    }
+    if (interval <= 0)
+        return;
+
+    Target target;
+    target.address = address;
+    target.command = command;
+    target.interval = qMax(int(MIN_INTERVAL), interval);
+    target.due = 0; // сразу
+    target.queued = 0;
+    target.failures = 0;
+    target.pending = false;
+    mTargets.append(target);
+}
+
+void Poller::clear()
+{
+    mTargets.clear();
+    mCursor = 0;
+}
+
+void Poller::setBudget(int pollsPerSecond)
+{
+    mBudget = qMax(0, pollsPerSecond);
+}
+
+bool Poller::next(qint64 now, int& address, int& command, qint64& wait)
+{
+    wait = -1;
+    if (mTargets.isEmpty())
+        return false;
+
+    // Бюджет шины: не чаще одного опроса в 1000/budget мс
+    qint64 budgetDue = (mBudget > 0) ? mLastPoll + 1000 / mBudget : 0;
+
+    qint64 earliest = -1;
+    int count = mTargets.size();
+    for (int i = 0; i < count; ++i)
+    {
+        int index = (mCursor + i) % count;
+        Target& target = mTargets[index];
+        if (target.pending)
+            continue;
+        if ((target.due <= now) && (budgetDue <= now))
+        {
+            address = target.address;
+            command = target.command;
+            target.pending = true;
+            target.queued = now;
+            target.due = now + interval(target);
+            mLastPoll = now;
+            mCursor = (index + 1) % count;
+            return true;
+        }
+        qint64 due = qMax(target.due, budgetDue);
+        if ((earliest < 0) || (due < earliest))
+            earliest = due;
+    }
+    if (earliest >= 0)
+        wait = qMax(qint64(0), earliest - now);
+    return false;
+}
+
+void Poller::replied(int address)
+{
+    if (Target* target = find(address))
+    {
+        target->pending = false;
+        target->failures = 0;
+    }
+}
+
+void Poller::timedOut(int address)
+{
+    if (Target* target = find(address))
+    {
+        bool wasSlow = target->failures >= FAILURES_TO_SLOW;
+        target->pending = false;
+        ++target->failures;
+        if (!wasSlow && (target->failures >= FAILURES_TO_SLOW))
+            target->due = target->queued + interval(*target);
+    }
+}
+
+void Poller::cancelled(int address)
+{
+    if (Target* target = find(address))
+        target->pending = false;
+}
+
+bool Poller::isEmpty() const
+{
+    return mTargets.isEmpty();
+}
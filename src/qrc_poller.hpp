@@ -0,0 +1,63 @@
+/******************************************************************************
+ *
+ * Quest Room Control
+ *
+ * Round-robin polling of boards on a bus
+ *
+ * (c) Roman A. Bulygin 2016
+ *
+ ******************************************************************************/
+
+#pragma once
+
+#ifndef _QRC_POLLER_HPP_
+#define _QRC_POLLER_HPP_
+
+#include <QList>
+
+#include "qrc_protocol.hpp"
+
+namespace qrc {
+
+// Расписание опроса плат одной шины.
+// Каждой плате - свой период и своя команда опроса, выбор среди созревших
+// по кругу. Общий бюджет шины ограничивает число опросов в секунду.
+// Плата, не ответившая несколько раз подряд, опрашивается редко, пока не ответит.
+class Poller
+{
+    struct Target
+    {
+        int address;
+        int command;
+        int interval;   // мс
+        qint64 due;     // когда опрашивать, мс
+        qint64 queued;  // когда поставлен в очередь текущий опрос, мс
+        int failures;   // таймаутов подряд
+        bool pending;   // опрос в очереди или на линии
+    };
+    QList<Target> mTargets;
+    int mCursor {0};      // с кого начинать поиск по кругу
+    int mBudget {0};      // опросов в секунду на шину, 0 - без ограничения
+    qint64 mLastPoll {0}; // когда выдан последний опрос, мс
+
+    Target* find(int address);
+    int interval(const Target& target) const;
+public:
+    // Опрашивать плату раз в interval мс командой command. interval <= 0 - перестать.
+    void setTarget(int address, int interval, int command = CMD_GET_STATE);
+    void clear();
+    void setBudget(int pollsPerSecond);
+
+    // Следующий опрос к моменту now: true и адрес с командой,
+    // иначе false и в wait - через сколько мс спросить снова (-1 - опрашивать некого).
+    bool next(qint64 now, int& address, int& command, qint64& wait);
+    void replied(int address);
+    void timedOut(int address);
+    void cancelled(int address); // опрос выброшен из очереди не отправленным
+
+    bool isEmpty() const;
+};
+
+} // namespace qrc
+
+#endif // _QRC_POLLER_HPP_
@@ -1,7 +1,11 @@
 #include "qrc_protocol.hpp"
+#include "qrc_ledpack.hpp"
+#include "qrc_scan.hpp"
 
 #include <QtEndian>
 
+#include <string.h>
+
 namespace qrc {
 
 enum {
@@ -23,38 +27,69 @@ enum {
 
 };
 
-static inline QByteArray encode_byte(unsigned char type, unsigned char data)
+// Байт по двум тетрадам с признаками, заодно набирает CRC
+static inline unsigned char* encode_byte(unsigned char* out, unsigned char type, unsigned char data, unsigned int& crc)
 {
-    return QByteArray()
-            .append(char(PAYLOAD_KIND_HI | type | ((data >> 4) & PAYLOAD_MASK)))
-            .append(char(PAYLOAD_KIND_LO | type | (data & PAYLOAD_MASK)));
+    unsigned char hi = PAYLOAD_KIND_HI | type | (data >> 4);
+    unsigned char lo = PAYLOAD_KIND_LO | type | (data & PAYLOAD_MASK);
+    crc += hi + lo;
+    out[0] = hi;
+    out[1] = lo;
+    return out + 2;
 }
 
-QByteArray request(unsigned char address, unsigned char command, const QByteArray& data)
+int encodeRequest(unsigned char address, unsigned char command,
+                  const unsigned char* data, int size, unsigned char* out)
 {
-    QByteArray result;
-    result.reserve(data.size()*2+5);
+    unsigned char* p = out;
     // Сначала признак начала команды и адрес
-    result.append(char(START_PACKET | (address & ADDRESS_MASK)));
+    *p = START_PACKET | (address & ADDRESS_MASK);
+    unsigned int crc = *p++;
     // Код команды
-    result.append(encode_byte(TYPE_CMD, command));
+    p = encode_byte(p, TYPE_CMD, command, crc);
     // Байты данных
-    for(unsigned char x : data)
-    {
-        result.append(encode_byte(TYPE_DATA, x));
-    }
-    // CRC
-    unsigned int crc = 0;
-    for(unsigned char x : result)
-    {
-        crc += x;
-    }
-    crc = crc & 0xFF;
-    result.append(encode_byte(TYPE_CRC, crc));
+    for (const unsigned char* end = data + size; data != end; ++data)
+        p = encode_byte(p, TYPE_DATA, *data, crc);
+    // CRC - сумма всех предыдущих байт
+    unsigned int unused = 0;
+    p = encode_byte(p, TYPE_CRC, crc & 0xFF, unused);
+    return int(p - out);
+}
 
+QByteArray request(unsigned char address, unsigned char command, const QByteArray& data)
+{
+    QByteArray result;
+    result.resize(packetSize(data.size()));
+    encodeRequest(address, command, reinterpret_cast<const unsigned char*>(data.constData()), data.size(),
+                  reinterpret_cast<unsigned char*>(result.data()));
     return result;
 }
 
+int packetSize(int dataSize)
+{
+    // начало с адресом, команда, данные и CRC по две тетрады
+    return 1 + 2 + dataSize*2 + 2;
+}
+
+int replySize(int command)
+{
+    switch (command)
+    {
+    case CMD_GET_KEYS:
+    case CMD_GET_STIKY_KEYS:
+        return 3;
+    case CMD_GET_SLIDERS:
+    case CMD_GET_ENCODERS:
+        return 8;
+    case CMD_GET_SENSORS:
+        return 2;
+    case CMD_GET_STATE:
+        return 24;
+    default:
+        return 0;
+    }
+}
+
 static inline
 bool glue_byte(unsigned char hi_byte, unsigned char lo_byte, unsigned char type, unsigned char& out_data)
 {
@@ -93,6 +128,11 @@ ost_parse_result parse_packet(
         data = packet;
         return PARSE_TAG_ERROR;
     }
+    if (actual_crc != expected_crc)
+    {
+        data = packet;
+        return PARSE_CRC_ERROR;
+    }
     // extract command
     if (!glue_byte(packet[1], packet[2], TYPE_CMD, command))
     {
@@ -121,10 +161,10 @@ ost_parse_result parse(
     QByteArray& data        // payload of packet (or special meaning on error)
 )
 {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(buffer.constData());
+
     // skip all before packet start
-    int pos = 0;
-    while ((pos < buffer.size()) && ((buffer[pos] & TAG_MASK) != START_PACKET))
-        ++pos;
+    int pos = findTag(bytes, buffer.size(), TAG_MASK, START_PACKET);
 
     if (pos > 0) // we was moved
     {
@@ -140,9 +180,7 @@ ost_parse_result parse(
         }
         return PARSE_SKIPPED;
     }
-    auto end_pos = pos;
-    while((end_pos < buffer.size()) && ((buffer[end_pos] & TAG_MASK) != (PAYLOAD_KIND_LO | TYPE_CRC)))
-        ++end_pos;
+    auto end_pos = pos + findTag(bytes + pos, buffer.size() - pos, TAG_MASK, PAYLOAD_KIND_LO | TYPE_CRC);
     if (end_pos == buffer.size())
         return PARSE_NONE; // Need more data
     ++end_pos;
@@ -155,6 +193,141 @@ ost_parse_result parse(
     return parse_packet(packet, address, command, data);
 }
 
+StreamParser::StreamParser()
+{}
+
+void StreamParser::compact()
+{
+    // Неразобранным бывает только хвост недошедшего пакета, двигать его дёшево
+    if (mHead == 0)
+        return;
+    memmove(mBuffer, mBuffer + mHead, size_t(mTail - mHead));
+    mTail -= mHead;
+    mScan -= mHead;
+    mHead = 0;
+}
+
+int StreamParser::feed(const char* bytes, int size)
+{
+    int space;
+    char* out = tail(space);
+    size = qMin(size, space);
+    memcpy(out, bytes, size_t(size));
+    commit(size);
+    return size;
+}
+
+char* StreamParser::tail(int& space)
+{
+    compact();
+    space = CAPACITY - mTail;
+    return reinterpret_cast<char*>(mBuffer + mTail);
+}
+
+void StreamParser::commit(int size)
+{
+    mTail = qMin(int(CAPACITY), mTail + qMax(0, size));
+}
+
+void StreamParser::reset()
+{
+    mHead = mTail = mScan = 0;
+}
+
+bool StreamParser::next(Packet& packet)
+{
+    packet.address = 0;
+    packet.command = 0;
+    if (mHead == mTail)
+        return false;
+
+    // skip all before packet start
+    int pos = mHead + findTag(mBuffer + mHead, mTail - mHead, TAG_MASK, START_PACKET);
+    if (pos > mHead)
+    {
+        packet.result = PARSE_SKIPPED;
+        packet.data = mBuffer + mHead;
+        packet.size = pos - mHead;
+        mHead = pos;
+        mScan = qMax(mScan, mHead);
+        return true;
+    }
+
+    // ищем младшую тетраду CRC, не пересматривая уже просмотренное
+    pos = qMax(mScan, mHead);
+    pos += findTag(mBuffer + pos, mTail - pos, TAG_MASK, PAYLOAD_KIND_LO | TYPE_CRC);
+    if (pos == mTail)
+    {
+        mScan = pos;
+        if ((mHead == 0) && (mTail == CAPACITY)) // конца нет на весь буфер - это не пакет
+        {
+            packet.result = PARSE_SIZE_ERROR;
+            packet.data = mBuffer;
+            packet.size = mTail;
+            mHead = mScan = mTail;
+            return true;
+        }
+        return false; // Need more data
+    }
+
+    unsigned char* start = mBuffer + mHead;
+    int size = pos + 1 - mHead;
+    mHead = mScan = pos + 1;
+
+    // при ошибке отдаём весь пакет
+    packet.data = start;
+    packet.size = size;
+    if ((size < MINIMAL_PACKET_SIZE) || ((size % 2) == 0))
+    {
+        packet.result = PARSE_SIZE_ERROR;
+        return true;
+    }
+    packet.address = start[0] & ADDRESS_MASK;
+
+    // Сначала проверка признаков и CRC, чтобы при ошибке отдать пакет нетронутым
+    unsigned int crc = sumBytes(start, size - 2);
+    unsigned char value;
+    packet.result = PARSE_TAG_ERROR;
+    if (!glue_byte(start[size-2], start[size-1], TYPE_CRC, value))
+        return true;
+    if (value != (crc & 0xFF))
+    {
+        packet.result = PARSE_CRC_ERROR;
+        return true;
+    }
+    if (!glue_byte(start[1], start[2], TYPE_CMD, packet.command))
+        return true;
+    if (!checkPairs(start + 3, (size - 5) / 2, TAG_MASK, PAYLOAD_KIND_HI | TYPE_DATA, PAYLOAD_KIND_LO | TYPE_DATA))
+        return true;
+
+    // Декодируем на месте: i-й байт данных пишется не дальше, чем читается
+    int count = (size - 5) / 2;
+    for (int i = 0; i < count; ++i)
+        start[3+i] = ((start[3+2*i] & PAYLOAD_MASK) << 4) | (start[4+2*i] & PAYLOAD_MASK);
+    packet.result = PARSE_SUCCESS;
+    packet.data = start + 3;
+    packet.size = count;
+    return true;
+}
+
+int baudRate(int index)
+{
+    static const int baudrates[BAUDRATE_115200+1] =
+    {
+        9600,
+        14400,
+        19200,
+        28800,
+        38400,
+        57600,
+        76800,
+        115200,
+    };
+    if ((index < BAUDRATE_9600) || (BAUDRATE_115200 < index))
+        return 0;
+    return baudrates[index];
+}
+
 QList<bool> getKeys(const QByteArray& data)
 {
     QList<bool> keys;
@@ -209,9 +382,33 @@ QList<int> getSensors(const QByteArray& data)
  * LedHelper
  ******************************************************************************/
 
+enum {
+    WORD_BITS = 64,
+};
+
+static inline int popCount(quint64 x)
+{
+#ifdef __GNUC__
+    return __builtin_popcountll(x);
+#else
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return int((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+// Биты [from, to) одного слова, 0 <= from < to <= 64
+static inline quint64 bitMask(int from, int to)
+{
+    quint64 high = (to == WORD_BITS) ? ~quint64(0) : ((quint64(1) << to) - 1);
+    return high & ~((quint64(1) << from) - 1);
+}
+
 LedHelper::LedHelper(int leds)
-    : mLeds((leds+7)%8, 0)
-    , mSize(leds)
+    : mWords((qMax(0, leds)+WORD_BITS-1)/WORD_BITS, 0)
+    , mLeds((qMax(0, leds)+7)/8, 0)
+    , mSize(qMax(0, leds))
 {}
 
 int LedHelper::size() const
@@ -219,12 +416,17 @@ int LedHelper::size() const
     return mSize;
 }
 
+quint64 LedHelper::lastMask() const
+{
+    int tail = mSize % WORD_BITS;
+    return (tail == 0) ? ~quint64(0) : bitMask(0, tail);
+}
+
 bool LedHelper::get(int index) const
 {
     if ((index < 0) || (mSize <= index))
         return false;
-    unsigned char mask = 1 << (index % 8);
-    return (mLeds[index/8] & mask) ==  mask;
+    return (mWords[index/WORD_BITS] >> (index % WORD_BITS)) & 1;
 }
 
 void LedHelper::set(int index, bool value)
@@ -232,15 +434,154 @@ void LedHelper::set(int index, bool value)
     if ((index < 0) || (mSize <= index))
         return;
 
-    unsigned char mask = 1 << (index % 8);
-    mLeds[index/8] = value ? (mLeds[index/8] | mask) : (mLeds[index/8] & (~mask)) ;
+    quint64 mask = quint64(1) << (index % WORD_BITS);
+    quint64& word = mWords[index/WORD_BITS];
+    word = value ? (word | mask) : (word & ~mask);
+    mDirty = true;
 }
 
 const QByteArray& LedHelper::data() const
 {
+    if (mDirty)
+    {
+        // Слово - 8 байт кадра, младший байт первым
+        unsigned char* out = reinterpret_cast<unsigned char*>(mLeds.data());
+        for (int i = 0; i < mLeds.size(); ++i)
+            out[i] = (unsigned char)(mWords[i/8] >> ((i % 8)*8));
+        mDirty = false;
+    }
     return mLeds;
 }
 
+bool LedHelper::setData(const QByteArray& data)
+{
+    mWords.fill(0);
+    int bytes = qMin(data.size(), mLeds.size());
+    for (int i = 0; i < bytes; ++i)
+        mWords[i/8] |= quint64((unsigned char)data[i]) << ((i % 8)*8);
+    if (!mWords.isEmpty())
+        mWords.last() &= lastMask();
+    mDirty = true;
+    return data.size() == mLeds.size();
+}
+
+// f(слово, маска битов диапазона в нём) для каждого задетого слова
+template <class F>
+void LedHelper::forRange(int first, int count, F f)
+{
+    if (first < 0)
+    {
+        count += first;
+        first = 0;
+    }
+    int end = qMin(mSize, first + count);
+    for (int from = first; from < end; )
+    {
+        int word = from / WORD_BITS;
+        int to = qMin(end, (word + 1) * WORD_BITS);
+        f(mWords[word], bitMask(from % WORD_BITS, to - word * WORD_BITS));
+        from = to;
+    }
+    mDirty = true;
+}
+
+void LedHelper::setRange(int first, int count, bool value)
+{
+    forRange(first, count, [value](quint64& word, quint64 mask) {
+        word = value ? (word | mask) : (word & ~mask);
+    });
+}
+
+void LedHelper::toggleRange(int first, int count)
+{
+    forRange(first, count, [](quint64& word, quint64 mask) { word ^= mask; });
+}
+
+void LedHelper::assign(const LedHelper& values, const LedHelper& mask)
+{
+    int words = qMin(mWords.size(), qMin(values.mWords.size(), mask.mWords.size()));
+    for (int i = 0; i < words; ++i)
+        mWords[i] = (mWords[i] & ~mask.mWords[i]) | (values.mWords[i] & mask.mWords[i]);
+    if (!mWords.isEmpty())
+        mWords.last() &= lastMask();
+    mDirty = true;
+}
+
+void LedHelper::rotate(int steps)
+{
+    if (mSize == 0)
+        return;
+    steps %= mSize;
+    if (steps < 0)
+        steps += mSize;
+    if (steps == 0)
+        return;
+
+    // Новый бит i = старый бит (i - steps) mod size: сдвиг слов целиком и на остаток
+    int words = mWords.size();
+    QVector<quint64> source = mWords;
+    for (int i = 0; i < words; ++i)
+        mWords[i] = 0;
+    for (int part = 0; part < 2; ++part)
+    {
+        // part 0: биты [0, size - steps) уходят вверх на steps,
+        // part 1: биты [size - steps, size) - в начало
+        int shift = (part == 0) ? steps : steps - mSize; // на сколько сдвинуть вверх
+        int from = (part == 0) ? 0 : mSize - steps;
+        int to = (part == 0) ? mSize - steps : mSize;
+        for (int w = from / WORD_BITS; w * WORD_BITS < to; ++w)
+        {
+            int lo = qMax(from, w * WORD_BITS);
+            int hi = qMin(to, (w + 1) * WORD_BITS);
+            quint64 bits = source[w] & bitMask(lo - w * WORD_BITS, hi - w * WORD_BITS);
+            int target = w * WORD_BITS + shift; // куда встаёт бит 0 этого слова
+            int t = (target >= 0) ? target / WORD_BITS : -((-target + WORD_BITS - 1) / WORD_BITS);
+            int offset = target - t * WORD_BITS; // 0..63
+            if ((0 <= t) && (t < words))
+                mWords[t] |= bits << offset;
+            if ((offset != 0) && (0 <= t + 1) && (t + 1 < words))
+                mWords[t + 1] |= bits >> (WORD_BITS - offset);
+        }
+    }
+    mDirty = true;
+}
+
+int LedHelper::count() const
+{
+    int total = 0;
+    for (quint64 word : mWords)
+        total += popCount(word);
+    return total;
+}
+
+LedHelper LedHelper::diff(const LedHelper& other) const
+{
+    LedHelper result(mSize);
+    int words = qMin(mWords.size(), other.mWords.size());
+    for (int i = 0; i < words; ++i)
+        result.mWords[i] = mWords[i] ^ other.mWords[i];
+    for (int i = words; i < mWords.size(); ++i)
+        result.mWords[i] = mWords[i];
+    result.mDirty = true;
+    return result;
+}
+
+int LedHelper::diffCount(const LedHelper& other) const
+{
+    int total = 0;
+    int words = qMin(mWords.size(), other.mWords.size());
+    for (int i = 0; i < words; ++i)
+        total += popCount(mWords[i] ^ other.mWords[i]);
+    for (int i = words; i < mWords.size(); ++i)
+        total += popCount(mWords[i]);
+    return total;
+}
+
+bool LedHelper::operator==(const LedHelper& other) const
+{
+    return (mSize == other.mSize) && (mWords == other.mWords);
+}
+
 /******************************************************************************
  * LedHelper
  ******************************************************************************/
@@ -294,4 +635,51 @@ const QByteArray& XLedHelper::data() const
     return mLeds;
 }
 
+bool XLedHelper::setData(const QByteArray& data)
+{
+    if (data.size() != mLeds.size())
+        return false;
+    mLeds = data;
+    return true;
+}
+
+static_assert(sizeof(LedRgb) == 3*sizeof(unsigned short), "LedRgb must be three packed channels");
+
+bool XLedHelper::clip(int& first, int& count) const
+{
+    if (first < 0)
+    {
+        count += first;
+        first = 0;
+    }
+    count = qMin(count, mSize - first);
+    return count > 0;
+}
+
+void XLedHelper::setRange(int first, const unsigned short* values, int count)
+{
+    int from = first;
+    if (!clip(first, count))
+        return;
+    packLeds12(values + (first - from), reinterpret_cast<unsigned char*>(mLeds.data()), mSize, first, count);
+}
+
+void XLedHelper::getRange(int first, unsigned short* values, int count) const
+{
+    int from = first;
+    if (!clip(first, count))
+        return;
+    unpackLeds12(reinterpret_cast<const unsigned char*>(mLeds.constData()), values + (first - from), mSize, first, count);
+}
+
+void XLedHelper::setGroups(int first, const LedRgb* groups, int count)
+{
+    setRange(first*3, reinterpret_cast<const unsigned short*>(groups), count*3);
+}
+
+void XLedHelper::getGroups(int first, LedRgb* groups, int count) const
+{
+    getRange(first*3, reinterpret_cast<unsigned short*>(groups), count*3);
+}
+
 } //namespace qrc
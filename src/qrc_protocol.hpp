@@ -15,11 +15,26 @@
 
 #include <QByteArray>
 #include <QList>
+#include <QVector>
 
 namespace qrc {
 
 QByteArray request(unsigned char address, unsigned char command, const QByteArray& data);
 
+// Размер пакета на линии для dataSize байт данных
+int packetSize(int dataSize);
+
+// Кодирует пакет в out без выделения памяти: в out должно быть не меньше packetSize(size) байт.
+// Возвращает число записанных байт, пакеты можно складывать в один буфер подряд.
+int encodeRequest(unsigned char address, unsigned char command,
+                  const unsigned char* data, int size, unsigned char* out);
+
+// Адрес узла при нескольких шинах: номер шины в старших битах,
+// адрес платы на шине - в младшей тетраде. Для шины 0 совпадает с адресом платы.
+static inline int nodeAddress(int bus, int address) { return (bus << 4) | (address & 0x0F); }
+static inline int nodeBus(int node) { return node >> 4; }
+static inline int nodeBoard(int node) { return node & 0x0F; }
+
 enum ost_parse_result {
     PARSE_NONE,       // nothing extracted
     PARSE_SUCCESS,    // packet extracted successfully
@@ -36,6 +51,50 @@ ost_parse_result parse(
     QByteArray& data        // payload of packet (or special meaning on error)
 );
 
+// Разбор потока без перевыделений: байты складываются в буфер постоянного размера,
+// поиск конца пакета продолжается с места, где остановился в прошлый раз,
+// данные декодируются на месте. Из одного куска readAll() выходит сколько угодно пакетов.
+class StreamParser
+{
+public:
+    enum {
+        CAPACITY = 1024, // байт, больше самого длинного пакета с запасом
+    };
+
+    // Результат разбора. data указывает внутрь буфера парсера и годится до следующего feed/commit/reset.
+    struct Packet
+    {
+        ost_parse_result result;
+        unsigned char address;
+        unsigned char command;
+        const unsigned char* data; // данные пакета, при ошибке - сырые байты (как у parse)
+        int size;
+
+        QByteArray toByteArray() const { return QByteArray(reinterpret_cast<const char*>(data), size); }
+    };
+
+    StreamParser();
+
+    // Скопировать байты в буфер, возвращает сколько влезло
+    int feed(const char* bytes, int size);
+    // Или читать прямо в буфер: space байт свободно по указателю, затем commit(прочитано)
+    char* tail(int& space);
+    void commit(int size);
+
+    // Следующий пакет, false - нужно больше данных
+    bool next(Packet& packet);
+    void reset();
+    int pending() const { return mTail - mHead; }
+
+private:
+    unsigned char mBuffer[CAPACITY];
+    int mHead {0}; // начало неразобранных байт
+    int mTail {0}; // конец принятых байт
+    int mScan {0}; // до сюда конца пакета точно нет
+
+    void compact();
+};
+
 enum {
     // Общие команды
     CMD_HELLO = 0x00,  // Пинг. Проверка связи.
@@ -60,6 +119,9 @@ enum {
     CMD_UNKNOWN = 0x81, // Неизвестная команда
 };
 
+// Сколько байт данных ожидается в ответе на команду (квитанция - 0)
+int replySize(int command);
+
 enum { 
     BAUDRATE_9600 = 0,
     BAUDRATE_14400 = 1,
@@ -71,6 +133,9 @@ enum {
     BAUDRATE_115200 = 7,
 };
 
+// Скорость в бодах по индексу BAUDRATE_*, 0 - неверный индекс
+int baudRate(int index);
+
 enum qrc_led_color {
     LED_RED = 0,
     LED_GREEN = 1,
@@ -105,28 +170,76 @@ QList<int> getEncoders(const QByteArray& data);
 // Из 2х байного (или менее) массива получает 2 значения сенсоров
 QList<int> getSensors(const QByteArray& data);
 
+// Простые светодиоды - битовое множество словами по 64 бита: диапазоны, маски
+// и сравнение с отправленным - несколько операций над словами на весь кадр.
+// На линии - бит i в байте i/8, младшими битами вперёд; data() собирает его
+// из слов только когда что-то поменялось.
 class LedHelper
 {
-    QByteArray mLeds;
+    QVector<quint64> mWords;    // лишние биты последнего слова всегда нули
+    mutable QByteArray mLeds;   // кадр для CMD_SET_LEDS
+    mutable bool mDirty {false}; // mLeds отстаёт от mWords
     int mSize {0};
+
+    quint64 lastMask() const;
+    template <class F> void forRange(int first, int count, F f);
 public:
     explicit LedHelper(int leds = QRC_LED_COUNT);
     int size() const;
     bool get(int index) const;
     void set(int index, bool value);
     const QByteArray& data() const;
+    // Кадр CMD_SET_LEDS: недостающие байты - нули. false - не тот размер
+    bool setData(const QByteArray& data);
+
+    // Светодиоды [first, first + count), выход за size() обрезается
+    void setRange(int first, int count, bool value);
+    void toggleRange(int first, int count);
+    void fill(bool value) { setRange(0, mSize, value); }
+    // Там, где в mask единицы, взять значения из values (размеры те же)
+    void assign(const LedHelper& values, const LedHelper& mask);
+    // Сдвиг по кругу: светодиод i переходит на место (i + steps) mod size()
+    void rotate(int steps);
+
+    int count() const; // сколько горит
+    // Чем отличается от other: единицы там, где состояния разные (например, от отправленного)
+    LedHelper diff(const LedHelper& other) const;
+    int diffCount(const LedHelper& other) const;
+    bool operator==(const LedHelper& other) const;
+    bool operator!=(const LedHelper& other) const { return !(*this == other); }
+};
+
+// Одна RGB-группа умных светодиодов, те же три канала подряд, что и в XLedHelper
+struct LedRgb
+{
+    unsigned short r;
+    unsigned short g;
+    unsigned short b;
 };
 
 class XLedHelper
 {
     QByteArray mLeds;
     int mSize;
+
+    bool clip(int& first, int& count) const;
 public:
     explicit XLedHelper(int leds = QRC_XLED_COUNT);
     int size() const;
     int get(int index) const;
     void set(int index, int value);
     const QByteArray& data() const;
+    bool setData(const QByteArray& data); // false - не тот размер
+
+    // Каналы [first, first + count) из массива и в массив за один проход
+    // (см. qrc::packLeds12), значения - младшие 12 бит. Выход за size() обрезается.
+    void setRange(int first, const unsigned short* values, int count);
+    void getRange(int first, unsigned short* values, int count) const;
+    void setAll(const unsigned short* values) { setRange(0, values, mSize); }
+    void getAll(unsigned short* values) const { getRange(0, values, mSize); }
+    // То же по RGB-группам: группа n - каналы 3n, 3n+1, 3n+2
+    void setGroups(int first, const LedRgb* groups, int count);
+    void getGroups(int first, LedRgb* groups, int count) const;
 };
 
 /*
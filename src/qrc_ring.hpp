@@ -0,0 +1,83 @@
+/******************************************************************************
+ *
+ * Quest Room Control
+ *
+ * Lock-free single producer / single consumer ring buffer
+ *
+ * (c) Roman A. Bulygin 2016
+ *
+ ******************************************************************************/
+
+#pragma once
+
+#ifndef _QRC_RING_HPP_
+#define _QRC_RING_HPP_
+
+#include <atomic>
+
+namespace qrc {
+
+// Кольцо на N записей (N - степень двойки) между ровно одним писателем и ровно одним читателем
+// в разных потоках. Без блокировок и без выделения памяти: записи копируются в готовый массив.
+// Счётчики растут без ограничения и переполняются, индекс - по маске.
+template <class T, unsigned N>
+class SpscRing
+{
+    static_assert((N >= 2) && ((N & (N - 1)) == 0), "size of SpscRing must be a power of two");
+
+    enum { CACHE_LINE = 64 };
+
+    T mItems[N];
+    char mPad0[CACHE_LINE];
+    std::atomic<unsigned> mHead {0}; // следующая для чтения, меняет только читатель
+    char mPad1[CACHE_LINE];
+    std::atomic<unsigned> mTail {0}; // следующая для записи, меняет только писатель
+    char mPad2[CACHE_LINE];
+
+public:
+    SpscRing() {}
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    static unsigned capacity() { return N; }
+
+    // Писатель. false - места нет, запись не добавлена
+    bool push(const T& item)
+    {
+        unsigned tail = mTail.load(std::memory_order_relaxed);
+        if (tail - mHead.load(std::memory_order_acquire) == N)
+            return false;
+        mItems[tail & (N - 1)] = item;
+        mTail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Читатель. false - пусто
+    bool pop(T& item)
+    {
+        return popBatch(&item, 1) == 1;
+    }
+
+    // Читатель: забрать до max записей за раз, возвращает сколько забрано
+    int popBatch(T* items, int max)
+    {
+        unsigned head = mHead.load(std::memory_order_relaxed);
+        unsigned available = mTail.load(std::memory_order_acquire) - head;
+        unsigned count = (max < 0) ? 0 : ((unsigned(max) < available) ? unsigned(max) : available);
+        for (unsigned i = 0; i < count; ++i)
+            items[i] = mItems[(head + i) & (N - 1)];
+        mHead.store(head + count, std::memory_order_release);
+        return int(count);
+    }
+
+    // Из любого потока - только приблизительно
+    bool isEmpty() const { return size() == 0; }
+    unsigned size() const
+    {
+        return mTail.load(std::memory_order_acquire) - mHead.load(std::memory_order_acquire);
+    }
+};
+
+} // namespace qrc
+
+#endif // _QRC_RING_HPP_
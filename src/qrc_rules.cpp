@@ -0,0 +1,324 @@
+/******************************************************************************
+ *
+ * Quest Room Control
+ *
+ * Quest logic rules compiled into lookup tables
+ *
+ * (c) Roman A. Bulygin 2016
+ *
+ ******************************************************************************/
+
+#include "qrc_rules.hpp"
+
+#include <QFile>
+#include <QObject>
+#include <QStringList>
+#include <QTextStream>
+
+#include <algorithm>
+
+#include <string.h>
+
+namespace qrc {
+
+// Число в пределах [min, max], десятичное или 0x..
+static bool parseNumber(const QString& text, int min, int max, int& value)
+{
+    bool ok = false;
+    value = text.toInt(&ok, 0);
+    return ok && (min <= value) && (value <= max);
+}
+
+// Адрес узла, на который можно слать команды с квитанцией (не широковещательный)
+static bool parseNode(const QString& text, int& address)
+{
+    return parseNumber(text, 0, RuleSet::ADDRESSES - 1, address)
+            && (nodeBoard(address) != 0) && (nodeBoard(address) != 15);
+}
+
+static bool parseTrigger(const QStringList& words, RuleTrigger& trigger)
+{
+    if ((words.size() < 3) || !parseNode(words[0], trigger.address))
+        return false;
+
+    const QString& input = words[1];
+    if ((input == "key") && (words.size() == 4))
+    {
+        if (!parseNumber(words[2], 0, QRC_KEY_COUNT - 1, trigger.index))
+            return false;
+        trigger.value = 0;
+        if (words[3] == "down")
+            trigger.kind = RuleTrigger::KEY_DOWN;
+        else if (words[3] == "up")
+            trigger.kind = RuleTrigger::KEY_UP;
+        else
+            return false;
+        return true;
+    }
+    if ((input == "stiky") && (words.size() <= 4))
+    {
+        if (!parseNumber(words[2], 0, QRC_STIKY_COUNT - 1, trigger.index))
+            return false;
+        trigger.value = 0;
+        if ((words.size() == 3) || (words[3] == "set"))
+            trigger.kind = RuleTrigger::STIKY_SET;
+        else if (words[3] == "clear")
+            trigger.kind = RuleTrigger::STIKY_CLEAR;
+        else
+            return false;
+        return true;
+    }
+    if (((input == "slider") || (input == "sensor")) && (words.size() == 5))
+    {
+        bool slider = (input == "slider");
+        if (!parseNumber(words[2], 0, (slider ? QRC_SLIDER_COUNT : QRC_SENSOR_COUNT) - 1, trigger.index)
+                || !parseNumber(words[4], 0, 0xFF, trigger.value))
+            return false;
+        if (words[3] == "above")
+            trigger.kind = slider ? RuleTrigger::SLIDER_ABOVE : RuleTrigger::SENSOR_ABOVE;
+        else if (words[3] == "below")
+            trigger.kind = slider ? RuleTrigger::SLIDER_BELOW : RuleTrigger::SENSOR_BELOW;
+        else
+            return false;
+        return true;
+    }
+    return false;
+}
+
+static bool parseAction(const QStringList& words, RuleAction& action)
+{
+    action.r = action.g = action.b = 0;
+    if ((words.size() == 4) && (words[0] == "relay"))
+    {
+        if (!parseNode(words[1], action.address) || !parseNumber(words[2], 0, QRC_RELAY_COUNT - 1, action.index))
+            return false;
+        if (words[3] == "on")
+            action.kind = RuleAction::RELAY_ON;
+        else if (words[3] == "off")
+            action.kind = RuleAction::RELAY_OFF;
+        else if (words[3] == "toggle")
+            action.kind = RuleAction::RELAY_TOGGLE;
+        else
+            return false;
+        return true;
+    }
+    if ((words.size() == 6) && (words[0] == "led"))
+    {
+        action.kind = RuleAction::SMART_LED;
+        return parseNode(words[1], action.address)
+                && parseNumber(words[2], 0, QRC_XLED_COUNT / 3 - 1, action.index)
+                && parseNumber(words[3], 0, 0x0FFF, action.r)
+                && parseNumber(words[4], 0, 0x0FFF, action.g)
+                && parseNumber(words[5], 0, 0x0FFF, action.b);
+    }
+    return false;
+}
+
+RuleSet::RuleSet()
+{
+    clear();
+}
+
+void RuleSet::clear()
+{
+    mTriggers.clear();
+    mActions.clear();
+    memset(mFirst, 0, sizeof(mFirst));
+    memset(mKeyMask, 0, sizeof(mKeyMask));
+    memset(mStikyMask, 0, sizeof(mStikyMask));
+    memset(mAnalog, 0, sizeof(mAnalog));
+}
+
+bool RuleSet::compile(const QString& text, QString& error)
+{
+    clear();
+
+    QStringList lines = text.split('\n');
+    for (int n = 0; n < lines.size(); ++n)
+    {
+        QString line = lines[n];
+        int comment = line.indexOf('#');
+        if (comment >= 0)
+            line.truncate(comment);
+        line = line.simplified();
+        if (line.isEmpty())
+            continue;
+
+        RuleTrigger trigger;
+        trigger.line = n + 1;
+        trigger.firstAction = mActions.size();
+        trigger.actionCount = 0;
+
+        int colon = line.indexOf(':');
+        if ((colon < 0) || !parseTrigger(line.left(colon).simplified().split(' '), trigger))
+        {
+            error = QObject::tr("Строка %1: неверное условие \"%2\"").arg(n + 1).arg(line);
+            clear();
+            return false;
+        }
+        for (const QString& part : line.mid(colon + 1).split(';'))
+        {
+            QString words = part.simplified();
+            if (words.isEmpty())
+                continue;
+            RuleAction action;
+            if (!parseAction(words.split(' '), action))
+            {
+                error = QObject::tr("Строка %1: неверное действие \"%2\"").arg(n + 1).arg(words);
+                clear();
+                return false;
+            }
+            mActions.append(action);
+            ++trigger.actionCount;
+        }
+        mTriggers.append(trigger);
+    }
+
+    // Условия одного адреса подряд, в порядке строк файла
+    std::stable_sort(mTriggers.begin(), mTriggers.end(),
+                     [](const RuleTrigger& a, const RuleTrigger& b) { return a.address < b.address; });
+
+    int index = 0;
+    for (int address = 0; address <= ADDRESSES; ++address)
+    {
+        mFirst[address] = index;
+        while ((index < mTriggers.size()) && (mTriggers[index].address == address))
+        {
+            const RuleTrigger& t = mTriggers[index];
+            switch (t.kind)
+            {
+            case RuleTrigger::KEY_DOWN:
+            case RuleTrigger::KEY_UP:
+                mKeyMask[address] |= 1u << t.index;
+                break;
+            case RuleTrigger::STIKY_SET:
+            case RuleTrigger::STIKY_CLEAR:
+                mStikyMask[address] |= 1u << t.index;
+                break;
+            default:
+                mAnalog[address] = true;
+                break;
+            }
+            ++index;
+        }
+    }
+    error.clear();
+    return true;
+}
+
+bool RuleSet::load(const QString& fileName, QString& error)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text))
+    {
+        clear();
+        error = QObject::tr("Не могу открыть файл правил %1").arg(fileName);
+        return false;
+    }
+    QTextStream stream(&file);
+    stream.setCodec("UTF-8");
+    return compile(stream.readAll(), error);
+}
+
+RuleEngine::RuleEngine()
+{
+    clear();
+}
+
+void RuleEngine::setRules(const RuleTable& rules)
+{
+    mRules = rules;
+}
+
+// Переход через порог между прошлым и новым значением
+static inline bool crossed(const RuleTrigger& t, int before, int now)
+{
+    switch (t.kind)
+    {
+    case RuleTrigger::SLIDER_ABOVE:
+    case RuleTrigger::SENSOR_ABOVE:
+        return (before < t.value) && (t.value <= now);
+    case RuleTrigger::SLIDER_BELOW:
+    case RuleTrigger::SENSOR_BELOW:
+        return (t.value <= before) && (now < t.value);
+    default:
+        return false;
+    }
+}
+
+int RuleEngine::update(const StateSnapshot& state, QVector<int>& fired)
+{
+    fired.resize(0);
+    int address = state.address & 0xFF;
+    if (mRules.isNull() || (mRules->first(address) == mRules->last(address)))
+        return 0;
+
+    StateSnapshot& last = mLast[address];
+    if (!mKnown[address])
+    {
+        mKnown[address] = true;
+        last = state;
+        return 0;
+    }
+
+    quint32 keys = (last.keys ^ state.keys) & mRules->keyMask(address);
+    quint32 stiky = (last.stiky ^ state.stiky) & mRules->stikyMask(address);
+    if ((keys == 0) && (stiky == 0) && !mRules->hasAnalog(address))
+    {
+        last = state;
+        return 0;
+    }
+
+    for (int i = mRules->first(address); i < mRules->last(address); ++i)
+    {
+        const RuleTrigger& t = mRules->trigger(i);
+        bool fire = false;
+        switch (t.kind)
+        {
+        case RuleTrigger::KEY_DOWN:
+            fire = ((keys >> t.index) & 1) && state.key(t.index);
+            break;
+        case RuleTrigger::KEY_UP:
+            fire = ((keys >> t.index) & 1) && !state.key(t.index);
+            break;
+        case RuleTrigger::STIKY_SET:
+            fire = ((stiky >> t.index) & 1) && state.stikyKey(t.index);
+            break;
+        case RuleTrigger::STIKY_CLEAR:
+            fire = ((stiky >> t.index) & 1) && !state.stikyKey(t.index);
+            break;
+        case RuleTrigger::SLIDER_ABOVE:
+        case RuleTrigger::SLIDER_BELOW:
+            fire = crossed(t, last.sliders[t.index], state.sliders[t.index]);
+            break;
+        case RuleTrigger::SENSOR_ABOVE:
+        case RuleTrigger::SENSOR_BELOW:
+            fire = crossed(t, last.sensors[t.index], state.sensors[t.index]);
+            break;
+        }
+        if (fire)
+            fired.append(i);
+    }
+    last = state;
+    return fired.size();
+}
+
+void RuleEngine::forget(int address)
+{
+    mKnown[address & 0xFF] = false;
+}
+
+void RuleEngine::clear()
+{
+    memset(mKnown, 0, sizeof(mKnown));
+}
+
+void registerRulesMetaType()
+{
+    static const int table = qRegisterMetaType<RuleTable>("qrc::RuleTable");
+    static const int action = qRegisterMetaType<RuleAction>("qrc::RuleAction");
+    Q_UNUSED(table)
+    Q_UNUSED(action)
+}
+
+} // namespace qrc
@@ -0,0 +1,150 @@
+/******************************************************************************
+ *
+ * Quest Room Control
+ *
+ * Quest logic rules compiled into lookup tables
+ *
+ * (c) Roman A. Bulygin 2016
+ *
+ ******************************************************************************/
+
+#pragma once
+
+#ifndef _QRC_RULES_HPP_
+#define _QRC_RULES_HPP_
+
+#include <QMetaType>
+#include <QSharedPointer>
+#include <QString>
+#include <QVector>
+
+#include "qrc_state.hpp"
+
+namespace qrc {
+
+// Что делает правило. Адрес - узел (см. nodeAddress), на шине которого и выполняется.
+struct RuleAction
+{
+    enum Kind
+    {
+        RELAY_ON,
+        RELAY_OFF,
+        RELAY_TOGGLE,
+        SMART_LED, // SET_SPECIFIC_SMART_LED: index - светодиод, r, g, b по 12 бит
+    };
+
+    Kind kind;
+    int address;
+    int index;
+    int r;
+    int g;
+    int b;
+};
+
+// Когда срабатывает правило: фронт кнопки или переход аналогового входа через порог
+struct RuleTrigger
+{
+    enum Kind
+    {
+        KEY_DOWN,
+        KEY_UP,
+        STIKY_SET,
+        STIKY_CLEAR,
+        SLIDER_ABOVE, // значение стало >= value
+        SLIDER_BELOW, // значение стало < value
+        SENSOR_ABOVE,
+        SENSOR_BELOW,
+    };
+
+    int address;
+    Kind kind;
+    int index;
+    int value;
+    int firstAction; // действия - RuleSet::action(firstAction .. firstAction + actionCount - 1)
+    int actionCount;
+    int line;        // строка файла правил, для журнала
+};
+
+// Правила из текста, по одному на строку, '#' - комментарий, адреса - десятичные или 0x..:
+//
+//   2 key 5 down: relay 3 1 on; led 3 4 4095 0 0
+//   0x12 sensor 0 above 100: relay 0x13 0 toggle
+//
+// Условия: key N down|up, stiky N [set|clear], slider N above|below V, sensor N above|below V.
+// Действия: relay УЗЕЛ N on|off|toggle, led УЗЕЛ N R G B.
+//
+// После compile() набор не меняется: условия отсортированы по адресу узла,
+// для каждого адреса - диапазон в плоском массиве и маски кнопок, так что
+// снимок платы без правил отбрасывается одним сравнением.
+class RuleSet
+{
+public:
+    enum {
+        ADDRESSES = 256,
+    };
+
+    RuleSet();
+
+    // false - ошибка, её описание с номером строки в error, набор при этом пуст
+    bool compile(const QString& text, QString& error);
+    bool load(const QString& fileName, QString& error);
+
+    int size() const { return mTriggers.size(); }
+    const RuleTrigger& trigger(int index) const { return mTriggers[index]; }
+    int actionCount() const { return mActions.size(); }
+    const RuleAction& action(int index) const { return mActions[index]; }
+
+    // Условия адреса - trigger(first(address)) .. trigger(last(address) - 1)
+    int first(int address) const { return mFirst[address & 0xFF]; }
+    int last(int address) const { return mFirst[(address & 0xFF) + 1]; }
+    // Кнопки и залипания, фронты которых что-то значат, бит на кнопку
+    quint32 keyMask(int address) const { return mKeyMask[address & 0xFF]; }
+    quint32 stikyMask(int address) const { return mStikyMask[address & 0xFF]; }
+    // Есть условия на слайдеры или сенсоры
+    bool hasAnalog(int address) const { return mAnalog[address & 0xFF]; }
+
+private:
+    void clear();
+
+    QVector<RuleTrigger> mTriggers;
+    QVector<RuleAction> mActions;
+    int mFirst[ADDRESSES + 1];
+    quint32 mKeyMask[ADDRESSES];
+    quint32 mStikyMask[ADDRESSES];
+    bool mAnalog[ADDRESSES];
+};
+
+// Общий неизменяемый набор: потоки шин читают его без блокировок
+typedef QSharedPointer<const RuleSet> RuleTable;
+
+// Выполнение правил на одной шине: прошлые снимки плат, от которых считаются
+// фронты и переходы через пороги. Живёт в потоке шины рядом с разбором ответов.
+class RuleEngine
+{
+public:
+    RuleEngine();
+
+    void setRules(const RuleTable& rules);
+    const RuleTable& rules() const { return mRules; }
+
+    // Сравнить снимок с прошлым по его адресу, номера сработавших условий - в fired
+    // (очищается, память переиспользуется). Первый снимок адреса только запоминается.
+    int update(const StateSnapshot& state, QVector<int>& fired);
+
+    void forget(int address);
+    void clear();
+
+private:
+    RuleTable mRules;
+    StateSnapshot mLast[RuleSet::ADDRESSES];
+    bool mKnown[RuleSet::ADDRESSES];
+};
+
+void registerRulesMetaType();
+
+} // namespace qrc
+
+Q_DECLARE_METATYPE(qrc::RuleTable)
+Q_DECLARE_METATYPE(qrc::RuleAction)
+
+#endif // _QRC_RULES_HPP_
@@ -0,0 +1,243 @@
+/******************************************************************************
+ *
+ * Quest Room Control
+ *
+ * Vectorized search of packet tags in the receive stream
+ *
+ * (c) Roman A. Bulygin 2016
+ *
+ ******************************************************************************/
+#include "qrc_scan.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define QRC_SCAN_X86 1
+#define QRC_SCAN_AVX2 1
+#define QRC_TARGET(x) __attribute__((target(x)))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && defined(_M_X64)
+#define QRC_SCAN_X86 1 // SSE2 есть на любом x64, AVX2 под MSVC не подключаем
+#define QRC_TARGET(x)
+#include <emmintrin.h>
+#endif
+
+namespace qrc {
+
+/******************************************************************************
+ * Побайтовая реализация, она же доделывает хвосты
+ ******************************************************************************/
+
+static int findTagScalar(const unsigned char* data, int size, unsigned char mask, unsigned char tag)
+{
+    int pos = 0;
+    while ((pos < size) && ((data[pos] & mask) != tag))
+        ++pos;
+    return pos;
+}
+
+static bool checkPairsScalar(const unsigned char* data, int pairs, unsigned char mask, unsigned char hi, unsigned char lo)
+{
+    for (int i = 0; i < pairs; ++i)
+    {
+        if (((data[2*i] & mask) != hi) || ((data[2*i+1] & mask) != lo))
+            return false;
+    }
+    return true;
+}
+
+static unsigned int sumBytesScalar(const unsigned char* data, int size)
+{
+    unsigned int sum = 0;
+    for (int i = 0; i < size; ++i)
+        sum += data[i];
+    return sum;
+}
+
+#ifdef QRC_SCAN_X86
+
+/******************************************************************************
+ * SSE2, по 16 байт
+ ******************************************************************************/
+
+static inline int lowestBit(unsigned int x)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, x);
+    return int(index);
+#else
+    return __builtin_ctz(x);
+#endif
+}
+
+QRC_TARGET("sse2")
+static int findTagSse2(const unsigned char* data, int size, unsigned char mask, unsigned char tag)
+{
+    const __m128i m = _mm_set1_epi8(char(mask));
+    const __m128i t = _mm_set1_epi8(char(tag));
+    int pos = 0;
+    for (; pos + 16 <= size; pos += 16)
+    {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+        unsigned int hits = unsigned(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(x, m), t)));
+        if (hits != 0)
+            return pos + lowestBit(hits);
+    }
+    return pos + findTagScalar(data + pos, size - pos, mask, tag);
+}
+
+QRC_TARGET("sse2")
+static bool checkPairsSse2(const unsigned char* data, int pairs, unsigned char mask, unsigned char hi, unsigned char lo)
+{
+    const __m128i m = _mm_set1_epi8(char(mask));
+    const __m128i t = _mm_set1_epi16(short((lo << 8) | hi)); // hi по чётным байтам, lo по нечётным
+    int size = pairs*2;
+    int pos = 0;
+    for (; pos + 16 <= size; pos += 16)
+    {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(x, m), t)) != 0xFFFF)
+            return false;
+    }
+    return checkPairsScalar(data + pos, (size - pos)/2, mask, hi, lo);
+}
+
+QRC_TARGET("sse2")
+static unsigned int sumBytesSse2(const unsigned char* data, int size)
+{
+    __m128i acc = _mm_setzero_si128();
+    int pos = 0;
+    for (; pos + 16 <= size; pos += 16)
+    {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(x, _mm_setzero_si128()));
+    }
+    unsigned int sum = unsigned(_mm_cvtsi128_si32(acc)) + unsigned(_mm_cvtsi128_si32(_mm_srli_si128(acc, 8)));
+    return sum + sumBytesScalar(data + pos, size - pos);
+}
+
+#endif // QRC_SCAN_X86
+
+#ifdef QRC_SCAN_AVX2
+
+/******************************************************************************
+ * AVX2, по 32 байта
+ ******************************************************************************/
+
+QRC_TARGET("avx2")
+static int findTagAvx2(const unsigned char* data, int size, unsigned char mask, unsigned char tag)
+{
+    const __m256i m = _mm256_set1_epi8(char(mask));
+    const __m256i t = _mm256_set1_epi8(char(tag));
+    int pos = 0;
+    for (; pos + 32 <= size; pos += 32)
+    {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos));
+        unsigned int hits = unsigned(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(x, m), t)));
+        if (hits != 0)
+            return pos + __builtin_ctz(hits);
+    }
+    return pos + findTagSse2(data + pos, size - pos, mask, tag);
+}
+
+QRC_TARGET("avx2")
+static bool checkPairsAvx2(const unsigned char* data, int pairs, unsigned char mask, unsigned char hi, unsigned char lo)
+{
+    const __m256i m = _mm256_set1_epi8(char(mask));
+    const __m256i t = _mm256_set1_epi16(short((lo << 8) | hi));
+    int size = pairs*2;
+    int pos = 0;
+    for (; pos + 32 <= size; pos += 32)
+    {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos));
+        if (unsigned(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(x, m), t))) != 0xFFFFFFFFu)
+            return false;
+    }
+    return checkPairsSse2(data + pos, (size - pos)/2, mask, hi, lo);
+}
+
+QRC_TARGET("avx2")
+static unsigned int sumBytesAvx2(const unsigned char* data, int size)
+{
+    __m256i acc = _mm256_setzero_si256();
+    int pos = 0;
+    for (; pos + 32 <= size; pos += 32)
+    {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(x, _mm256_setzero_si256()));
+    }
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    unsigned int sum = unsigned(_mm_cvtsi128_si32(half)) + unsigned(_mm_cvtsi128_si32(_mm_srli_si128(half, 8)));
+    return sum + sumBytesSse2(data + pos, size - pos);
+}
+
+#endif // QRC_SCAN_AVX2
+
+/******************************************************************************
+ * Выбор реализации
+ ******************************************************************************/
+
+struct ScanFunctions
+{
+    int (*findTag)(const unsigned char*, int, unsigned char, unsigned char);
+    bool (*checkPairs)(const unsigned char*, int, unsigned char, unsigned char, unsigned char);
+    unsigned int (*sumBytes)(const unsigned char*, int);
+    const char* name;
+
+    ScanFunctions()
+        : findTag(findTagScalar)
+        , checkPairs(checkPairsScalar)
+        , sumBytes(sumBytesScalar)
+        , name("scalar")
+    {
+#if defined(QRC_SCAN_AVX2)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+        {
+            findTag = findTagAvx2;
+            checkPairs = checkPairsAvx2;
+            sumBytes = sumBytesAvx2;
+            name = "avx2";
+        }
+        else if (__builtin_cpu_supports("sse2"))
+        {
+            findTag = findTagSse2;
+            checkPairs = checkPairsSse2;
+            sumBytes = sumBytesSse2;
+            name = "sse2";
+        }
+#elif defined(QRC_SCAN_X86)
+        findTag = findTagSse2;
+        checkPairs = checkPairsSse2;
+        sumBytes = sumBytesSse2;
+        name = "sse2";
+#endif
+    }
+};
+
+static const ScanFunctions& scanFunctions()
+{
+    static const ScanFunctions functions; // потокобезопасно с C++11
+    return functions;
+}
+
+int findTag(const unsigned char* data, int size, unsigned char mask, unsigned char tag)
+{
+    return scanFunctions().findTag(data, size, mask, tag);
+}
+
+bool checkPairs(const unsigned char* data, int pairs, unsigned char mask, unsigned char hi, unsigned char lo)
+{
+    return scanFunctions().checkPairs(data, pairs, mask, hi, lo);
+}
+
+unsigned int sumBytes(const unsigned char* data, int size)
+{
+    return scanFunctions().sumBytes(data, size);
+}
+
+const char* scanImplementation()
+{
+    return scanFunctions().name;
+}
+
+} // namespace qrc
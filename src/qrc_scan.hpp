@@ -0,0 +1,36 @@
+/******************************************************************************
+ *
+ * Quest Room Control
+ *
+ * Vectorized search of packet tags in the receive stream
+ *
+ * (c) Roman A. Bulygin 2016
+ *
+ ******************************************************************************/
+
+#pragma once
+
+#ifndef _QRC_SCAN_HPP_
+#define _QRC_SCAN_HPP_
+
+namespace qrc {
+
+// Поиск и проверка признаков (старшая тетрада байта) сразу по 16/32 байта.
+// Реализация выбирается при первом вызове по возможностям процессора:
+// AVX2, SSE2 или побайтовая.
+
+// Позиция первого байта с (byte & mask) == tag, size - если такого нет
+int findTag(const unsigned char* data, int size, unsigned char mask, unsigned char tag);
+
+// Все пары байт имеют признаки hi, lo: (data[2i] & mask) == hi, (data[2i+1] & mask) == lo
+bool checkPairs(const unsigned char* data, int pairs, unsigned char mask, unsigned char hi, unsigned char lo);
+
+// Сумма байт (для CRC)
+unsigned int sumBytes(const unsigned char* data, int size);
+
+// Какая реализация выбрана: "avx2", "sse2" или "scalar"
+const char* scanImplementation();
+
+} // namespace qrc
+
+#endif // _QRC_SCAN_HPP_
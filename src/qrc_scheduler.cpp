@@ -0,0 +1,285 @@
+/******************************************************************************
+ *
+ * Quest Room Control
+ *
+ * Priority scheduler of bus transactions
+ *
+ * (c) Roman A. Bulygin 2016
+ *
+ ******************************************************************************/
+#include "qrc_scheduler.hpp"
+
+#include "qrc_protocol.hpp"
+
+using namespace qrc;
+
+enum {
+    LIMIT_LEDS = 16,
+    LIMIT_POLL = 16,
+    LIMIT_DIAGNOSTIC = 16,
+    MAX_AGE_POLL = 1000, // ms, опрос старше секунды уже никому не интересен
+    PROMOTE_POLL = 250,  // ms, дальше опрос встаёт в общую очередь с кадрами светодиодов
+    PROMOTE_DIAGNOSTIC = 250, // ms, чтобы поиск плат не голодал за опросом и кадрами
+};
+
+Priority qrc::commandPriority(int command)
+{
+    switch (command)
+    {
+    case CMD_SET_RELAY:
+        return PRIORITY_OUTPUT;
+    case CMD_SET_LEDS:
+    case CMD_SET_SMART_LEDS:
+    case CMD_SET_TEXT:
+    case SET_SPECIFIC_SMART_LEDS_8:
+    case SET_SPECIFIC_SMART_LEDS_4:
+    case SET_SPECIFIC_SMART_LED:
+        return PRIORITY_LEDS;
+    case CMD_GET_KEYS:
+    case CMD_GET_SLIDERS:
+    case CMD_GET_ENCODERS:
+    case CMD_GET_SENSORS:
+    case CMD_GET_STIKY_KEYS:
+    case CMD_GET_STATE:
+        return PRIORITY_POLL;
+    case CMD_HELLO:
+    case CMD_SET_BAUDRATE:
+    default:
+        return PRIORITY_DIAGNOSTIC;
+    }
+}
+
+enum WriteKind {
+    WRITE_NONE,
+    WRITE_RELAY,
+    WRITE_LEDS,
+    WRITE_SMART_LEDS,
+};
+
+// Что перезаписывает команда на плате: вид выходов и диапазон [first, last)
+static inline
+WriteKind writeRegion(const Transaction& t, int& first, int& last)
+{
+    int index = t.data.isEmpty() ? 0 : (unsigned char)t.data[0];
+    switch (t.command)
+    {
+    case CMD_SET_RELAY:
+        first = 0;
+        last = QRC_RELAY_COUNT;
+        return WRITE_RELAY;
+    case CMD_SET_LEDS:
+        first = 0;
+        last = QRC_LED_COUNT;
+        return WRITE_LEDS;
+    case CMD_SET_SMART_LEDS:
+        first = 0;
+        last = QRC_XLED_COUNT/3;
+        return WRITE_SMART_LEDS;
+    case SET_SPECIFIC_SMART_LEDS_8:
+        first = index*8;
+        last = first+8;
+        return WRITE_SMART_LEDS;
+    case SET_SPECIFIC_SMART_LEDS_4:
+        first = index*4;
+        last = first+4;
+        return WRITE_SMART_LEDS;
+    case SET_SPECIFIC_SMART_LED:
+        first = index;
+        last = first+1;
+        return WRITE_SMART_LEDS;
+    default:
+        return WRITE_NONE;
+    }
+}
+
+Scheduler::Scheduler()
+{
+    limits[PRIORITY_OUTPUT] = 0; // выходы не вытесняются никогда
+    limits[PRIORITY_LEDS] = LIMIT_LEDS;
+    limits[PRIORITY_POLL] = LIMIT_POLL;
+    limits[PRIORITY_DIAGNOSTIC] = LIMIT_DIAGNOSTIC;
+
+    maxAges[PRIORITY_OUTPUT] = 0;
+    maxAges[PRIORITY_LEDS] = 0;
+    maxAges[PRIORITY_POLL] = MAX_AGE_POLL;
+    maxAges[PRIORITY_DIAGNOSTIC] = 0;
+
+    promoteAfters[PRIORITY_OUTPUT] = 0;
+    promoteAfters[PRIORITY_LEDS] = 0;
+    promoteAfters[PRIORITY_POLL] = PROMOTE_POLL;
+    promoteAfters[PRIORITY_DIAGNOSTIC] = PROMOTE_DIAGNOSTIC;
+}
+
+void Scheduler::setLimit(int priority, int depth)
+{
+    if ((priority < 0) || (PRIORITY_COUNT <= priority))
+        return;
+    limits[priority] = (priority == PRIORITY_OUTPUT) ? 0 : qMax(1, depth);
+}
+
+void Scheduler::setMaxAge(int priority, int msec)
+{
+    if ((priority < 0) || (PRIORITY_COUNT <= priority))
+        return;
+    maxAges[priority] = (priority == PRIORITY_OUTPUT) ? 0 : qMax(0, msec);
+}
+
+void Scheduler::coalesce(const Transaction& transaction)
+{
+    int first, last;
+    WriteKind kind = writeRegion(transaction, first, last);
+    if (kind == WRITE_NONE)
+        return;
+
+    for (int priority = 0; priority < PRIORITY_COUNT; ++priority)
+    {
+        QQueue<Transaction>& queue = queues[priority];
+        for (int i = 0; i < queue.size(); )
+        {
+            const Transaction& t = queue.at(i);
+            int tFirst, tLast;
+            if ((t.address == transaction.address)
+                    && (writeRegion(t, tFirst, tLast) == kind)
+                    && (first <= tFirst) && (tLast <= last))
+                queue.removeAt(i);
+            else
+                ++i;
+        }
+    }
+}
+
+void Scheduler::setPromoteAfter(int priority, int msec)
+{
+    if ((priority < 0) || (PRIORITY_COUNT <= priority))
+        return;
+    promoteAfters[priority] = qMax(0, msec);
+}
+
+void Scheduler::push(const Transaction& transaction, QList<Transaction>& dropped)
+{
+    coalesce(transaction);
+
+    int priority = qBound(0, transaction.priority, PRIORITY_COUNT-1);
+    QQueue<Transaction>& queue = queues[priority];
+    if (!transaction.reserved && (limits[priority] > 0))
+    {
+        // Вытесняем самые старые, кроме reserved
+        for (int i = 0, count = depth(priority); (count >= limits[priority]) && (i < queue.size()); )
+        {
+            if (queue.at(i).reserved)
+                ++i;
+            else
+            {
+                dropped.append(queue.takeAt(i));
+                --count;
+            }
+        }
+    }
+    queue.enqueue(transaction);
+    queue.last().priority = priority;
+    queue.last().origin = priority;
+}
+
+// Возраст меряется пределом исходного класса: повышенный опрос не должен
+// ни жить дольше MAX_AGE_POLL, ни умирать по сроку кадров светодиодов
+bool Scheduler::expired(const Transaction& transaction, qint64 now) const
+{
+    qint64 age = now - transaction.queued;
+    int maxAge = maxAges[transaction.origin];
+    return ((maxAge > 0) && (age > maxAge))
+            || ((transaction.maxAge > 0) && (age > transaction.maxAge));
+}
+
+// Занятое место в очереди класса: reserved не в счёт
+int Scheduler::depth(int priority) const
+{
+    int count = 0;
+    for (const Transaction& t : queues[priority])
+        if (!t.reserved)
+            ++count;
+    return count;
+}
+
+bool Scheduler::pop(qint64 now, Transaction& transaction, QList<Transaction>& dropped)
+{
+    // Заждавшиеся поднимаем на класс выше. Очередь упорядочена по времени,
+    // так что достаточно смотреть с головы.
+    for (int priority = 1; priority < PRIORITY_COUNT; ++priority)
+    {
+        QQueue<Transaction>& queue = queues[priority];
+        QQueue<Transaction>& target = queues[priority-1];
+        if (promoteAfters[priority] <= 0)
+            continue;
+        while (!queue.isEmpty() && (now - queue.head().queued > promoteAfters[priority]))
+        {
+            if (expired(queue.head(), now))
+            {
+                dropped.append(queue.dequeue());
+                continue;
+            }
+            // Повышение не вытесняет чужие запросы: нет места - ждём в своём классе
+            if (!queue.head().reserved && (limits[priority-1] > 0) && (depth(priority-1) >= limits[priority-1]))
+                break;
+            Transaction promoted = queue.dequeue();
+            promoted.priority = priority-1;
+            // Встаёт по времени постановки: поставленные позже него уходят после
+            int i = target.size();
+            while ((i > 0) && (target.at(i-1).queued > promoted.queued))
+                --i;
+            target.insert(i, promoted);
+        }
+    }
+
+    for (int priority = 0; priority < PRIORITY_COUNT; ++priority)
+    {
+        QQueue<Transaction>& queue = queues[priority];
+        while (!queue.isEmpty())
+        {
+            transaction = queue.dequeue();
+            if (expired(transaction, now))
+            {
+                dropped.append(transaction);
+                continue;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+void Scheduler::cancel(int address, int command, QList<Transaction>& dropped)
+{
+    for (int priority = 0; priority < PRIORITY_COUNT; ++priority)
+    {
+        QQueue<Transaction>& queue = queues[priority];
+        for (int i = 0; i < queue.size(); )
+        {
+            const Transaction& t = queue.at(i);
+            if ((t.address == address) && ((command < 0) || (t.command == command)))
+                dropped.append(queue.takeAt(i));
+            else
+                ++i;
+        }
+    }
+}
+
+void Scheduler::clear()
+{
+    for (int priority = 0; priority < PRIORITY_COUNT; ++priority)
+        queues[priority].clear();
+}
+
+bool Scheduler::isEmpty() const
+{
+    for (int priority = 0; priority < PRIORITY_COUNT; ++priority)
+        if (!queues[priority].isEmpty())
+            return false;
+    return true;
+}
+
+int Scheduler::size(int priority) const
+{
+    if ((priority < 0) || (PRIORITY_COUNT <= priority))
+        return 0;
+    return queues[priority].size();
+}
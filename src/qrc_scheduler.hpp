@@ -0,0 +1,102 @@
+/******************************************************************************
+ *
+ * Quest Room Control
+ *
+ * Priority scheduler of bus transactions
+ *
+ * (c) Roman A. Bulygin 2016
+ *
+ ******************************************************************************/
+
+#pragma once
+
+#ifndef _QRC_SCHEDULER_HPP_
+#define _QRC_SCHEDULER_HPP_
+
+#include <QByteArray>
+#include <QList>
+#include <QQueue>
+
+namespace qrc {
+
+// Классы приоритета. Чем меньше значение, тем раньше уйдёт запрос.
+enum Priority
+{
+    PRIORITY_OUTPUT = 0,     // реле и всё, что связано с безопасностью
+    PRIORITY_LEDS = 1,       // кадры светодиодов
+    PRIORITY_POLL = 2,       // опрос состояния
+    PRIORITY_DIAGNOSTIC = 3, // пинг, смена скорости и прочее служебное
+    PRIORITY_COUNT,
+    PRIORITY_DEFAULT = -1,   // определить по коду команды
+};
+
+// Класс приоритета по умолчанию для команды
+Priority commandPriority(int command);
+
+struct Transaction
+{
+    int address {0};
+    int command {0};
+    QByteArray data;
+    int priority {PRIORITY_DIAGNOSTIC};
+    int origin {PRIORITY_DIAGNOSTIC}; // класс при постановке, до повышений
+    qint64 queued {0}; // момент постановки в очередь, мс
+    int tag {0};       // метка служебных транзакций самого обработчика порта
+    int timeout {0};   // таймаут ответа, мс. 0 - по оценке времени реакции платы
+    bool reserved {false}; // сверх глубины очереди: не вытесняется и места не занимает
+    int maxAge {0};    // свой предельный возраст, мс, сверх предела класса. 0 - только класс
+};
+
+// Очереди запросов по классам приоритета.
+// Выдаёт запросы строго по старшинству классов, внутри класса - в порядке
+// поступления. Худшее время ожидания реле ограничено временем одной текущей
+// транзакции плюс реле, уже стоящими в очереди перед ним.
+// Записи реле и светодиодов сливаются: новая запись на адрес вытесняет ещё не
+// отправленные записи, которые она целиком перекрывает, и встаёт в конец очереди.
+// Так серия правок уходит на плату одной передачей с последним состоянием.
+// Очередь выходов не ограничена ни глубиной, ни возрастом: реле не теряются,
+// а расти ей не даёт то же слияние - на адрес стоит не больше одной записи реле.
+// Чтобы опрос не голодал за потоком кадров светодиодов, запрос, прождавший
+// в своём классе дольше заданного, переходит в класс выше, если там есть место,
+// и встаёт там по времени постановки - перед запросами, поставленными позже него.
+// Предельный возраст - всегда исходного класса, и после повышения.
+// Запросы reserved (пачка поиска плат, восстановление кадра светодиодов) идут
+// сверх глубины очереди: их не вытесняют и они не вытесняют других, а повышаются
+// без оглядки на место в классе выше.
+class Scheduler
+{
+    QQueue<Transaction> queues[PRIORITY_COUNT];
+    int limits[PRIORITY_COUNT];
+    int maxAges[PRIORITY_COUNT];
+    int promoteAfters[PRIORITY_COUNT];
+
+    void coalesce(const Transaction& transaction);
+    bool expired(const Transaction& transaction, qint64 now) const;
+    int depth(int priority) const;
+public:
+    Scheduler();
+
+    // Предельная глубина очереди класса. При переполнении вытесняется самый старый запрос.
+    // Для PRIORITY_OUTPUT не действует.
+    void setLimit(int priority, int depth);
+    // Предельный возраст запроса класса в мс, 0 - без ограничения. Устаревшие запросы не отправляются.
+    // Для PRIORITY_OUTPUT не действует.
+    void setMaxAge(int priority, int msec);
+    // Через сколько мс ожидания запрос класса переходит в класс выше, 0 - никогда.
+    void setPromoteAfter(int priority, int msec);
+
+    // Ставит запрос в очередь. Вытесненные запросы добавляются в dropped.
+    void push(const Transaction& transaction, QList<Transaction>& dropped);
+    // Извлекает следующий запрос. Устаревшие по пути запросы добавляются в dropped.
+    bool pop(qint64 now, Transaction& transaction, QList<Transaction>& dropped);
+    // Убирает из очередей запросы на адрес (command < 0 - любые команды).
+    void cancel(int address, int command, QList<Transaction>& dropped);
+    void clear();
+
+    bool isEmpty() const;
+    int size(int priority) const;
+};
+
+} // namespace qrc
+
+#endif // _QRC_SCHEDULER_HPP_
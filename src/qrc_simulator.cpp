@@ -0,0 +1,542 @@
+/******************************************************************************
+ *
+ * Quest Room Control
+ *
+ * Software emulation of boards on a bus
+ *
+ * (c) Roman A. Bulygin 2016
+ *
+ ******************************************************************************/
+#include "qrc_simulator.hpp"
+
+#include "qrc_timing.hpp"
+
+#include <QMutexLocker>
+#include <QtEndian>
+
+#include <string.h>
+
+#ifdef Q_OS_UNIX
+#include <QSocketNotifier>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+#endif
+
+using namespace qrc;
+
+enum {
+    KEY_BYTES = 3,
+    FRAME_BYTES = QRC_XLED_COUNT * 12 / 8,
+    DRIVER_BYTES = 36,
+    HALF_BYTES = 18,
+    SINGLE_BYTES = 7,
+    STATE_BYTES = 24,
+    NOISE_MAX = 8, // байт мусора при сбое
+};
+
+/******************************************************************************
+ * BusSimulator
+ ******************************************************************************/
+
+BusSimulator::Board::Board()
+    : baudRate(BAUDRATE_9600)
+    , relays(0)
+    , keys(0)
+    , stiky(0)
+{
+    for (auto& x : sliders)
+        x = 0;
+    for (auto& x : encoders)
+        x = 0;
+    for (auto& x : sensors)
+        x = 0;
+}
+
+BusSimulator::BusSimulator()
+{}
+
+void BusSimulator::addBoard(int address)
+{
+    QMutexLocker lock(&mMutex);
+    address &= 0x0F;
+    if ((address == 0) || (address == 15)) // широковещательные адреса
+        return;
+    if (!mBoards.contains(address))
+        mBoards.insert(address, Board());
+}
+
+void BusSimulator::removeBoard(int address)
+{
+    QMutexLocker lock(&mMutex);
+    mBoards.remove(address & 0x0F);
+}
+
+QList<int> BusSimulator::boards() const
+{
+    QMutexLocker lock(&mMutex);
+    return mBoards.keys();
+}
+
+void BusSimulator::setKey(int address, int key, bool down)
+{
+    QMutexLocker lock(&mMutex);
+    if (!mBoards.contains(address & 0x0F) || (key < 0) || (QRC_KEY_COUNT <= key))
+        return;
+    Board& board = mBoards[address & 0x0F];
+    quint32 mask = 1u << key;
+    board.keys = down ? (board.keys | mask) : (board.keys & ~mask);
+    if (down)
+        board.stiky |= mask;
+}
+
+void BusSimulator::clearStikyKeys(int address)
+{
+    QMutexLocker lock(&mMutex);
+    if (mBoards.contains(address & 0x0F))
+        mBoards[address & 0x0F].stiky = 0;
+}
+
+void BusSimulator::setSlider(int address, int slider, int value)
+{
+    QMutexLocker lock(&mMutex);
+    if (mBoards.contains(address & 0x0F) && (0 <= slider) && (slider < QRC_SLIDER_COUNT))
+        mBoards[address & 0x0F].sliders[slider] = qBound(0, value, 0xFF);
+}
+
+void BusSimulator::setEncoder(int address, int encoder, int value)
+{
+    QMutexLocker lock(&mMutex);
+    if (mBoards.contains(address & 0x0F) && (0 <= encoder) && (encoder < QRC_ENCODER_COUNT))
+        mBoards[address & 0x0F].encoders[encoder] = quint16(value);
+}
+
+void BusSimulator::setSensor(int address, int sensor, int value)
+{
+    QMutexLocker lock(&mMutex);
+    if (mBoards.contains(address & 0x0F) && (0 <= sensor) && (sensor < QRC_SENSOR_COUNT))
+        mBoards[address & 0x0F].sensors[sensor] = qBound(0, value, 0xFF);
+}
+
+unsigned char BusSimulator::relays(int address) const
+{
+    QMutexLocker lock(&mMutex);
+    return mBoards.contains(address & 0x0F) ? mBoards[address & 0x0F].relays : 0;
+}
+
+QByteArray BusSimulator::leds(int address) const
+{
+    QMutexLocker lock(&mMutex);
+    return mBoards.contains(address & 0x0F) ? mBoards[address & 0x0F].leds.data() : QByteArray();
+}
+
+QByteArray BusSimulator::smartLeds(int address) const
+{
+    QMutexLocker lock(&mMutex);
+    return mBoards.contains(address & 0x0F) ? mBoards[address & 0x0F].smartLeds.data() : QByteArray();
+}
+
+QByteArray BusSimulator::text(int address) const
+{
+    QMutexLocker lock(&mMutex);
+    return mBoards.contains(address & 0x0F) ? mBoards[address & 0x0F].text : QByteArray();
+}
+
+int BusSimulator::baudRate(int address) const
+{
+    QMutexLocker lock(&mMutex);
+    return mBoards.contains(address & 0x0F) ? mBoards[address & 0x0F].baudRate : BAUDRATE_9600;
+}
+
+void BusSimulator::setFaults(int dropPercent, int corruptPercent, int noisePercent)
+{
+    QMutexLocker lock(&mMutex);
+    mDropPercent = qBound(0, dropPercent, 100);
+    mCorruptPercent = qBound(0, corruptPercent, 100);
+    mNoisePercent = qBound(0, noisePercent, 100);
+}
+
+void BusSimulator::setSeed(quint32 seed)
+{
+    QMutexLocker lock(&mMutex);
+    mSeed = seed ? seed : 1;
+}
+
+int BusSimulator::random(int range)
+{
+    // xorshift: повторяемые прогоны при одинаковом зерне
+    mSeed ^= mSeed << 13;
+    mSeed ^= mSeed >> 17;
+    mSeed ^= mSeed << 5;
+    return (range > 0) ? int(mSeed % quint32(range)) : 0;
+}
+
+QByteArray BusSimulator::stateData(const Board& board) const
+{
+    QByteArray data;
+    data.reserve(STATE_BYTES);
+    for (int i = 0; i < KEY_BYTES; ++i)
+        data.append(char((board.keys >> (8*i)) & 0xFF));
+    for (int i = 0; i < QRC_SLIDER_COUNT; ++i)
+        data.append(char(board.sliders[i]));
+    for (int i = 0; i < QRC_ENCODER_COUNT; ++i)
+        data.append(char(board.encoders[i] & 0xFF)).append(char(board.encoders[i] >> 8));
+    for (int i = 0; i < QRC_SENSOR_COUNT; ++i)
+        data.append(char(board.sensors[i]));
+    for (int i = 0; i < KEY_BYTES; ++i)
+        data.append(char((board.stiky >> (8*i)) & 0xFF));
+    return data;
+}
+
+QByteArray BusSimulator::execute(Board& board, int address, int command, const QByteArray& data, bool& silent)
+{
+    int index = data.isEmpty() ? 0 : (unsigned char)data[0];
+    switch (command)
+    {
+    case CMD_HELLO:
+        return request(address, CMD_HELLO, QByteArray());
+    case CMD_SET_BAUDRATE:
+    {
+        // Квитанция уходит ещё на старой скорости
+        QByteArray ticket = request(address, CMD_SUCCESS, QByteArray());
+        if ((qrc::baudRate(index) != 0) && (data.size() == 1))
+            board.baudRate = index;
+        return ticket;
+    }
+    case CMD_SET_LEDS:
+        board.leds.setData(data);
+        break;
+    case CMD_SET_SMART_LEDS:
+        board.smartLeds.setData(data);
+        break;
+    case CMD_SET_TEXT:
+        board.text = data;
+        break;
+    case CMD_SET_RELAY:
+        board.relays = (unsigned char)index;
+        break;
+    case SET_SPECIFIC_SMART_LEDS_8:
+    case SET_SPECIFIC_SMART_LEDS_4:
+    {
+        // Светодиоды в кадре задом наперёд: драйвер (половина) n - n-й кусок с конца
+        int chunk = (command == SET_SPECIFIC_SMART_LEDS_8) ? DRIVER_BYTES : HALF_BYTES;
+        int offset = FRAME_BYTES - (index+1)*chunk;
+        if ((offset >= 0) && (data.size() == chunk+1))
+        {
+            QByteArray frame = board.smartLeds.data();
+            frame.replace(offset, chunk, data.mid(1));
+            board.smartLeds.setData(frame);
+        }
+        break;
+    }
+    case SET_SPECIFIC_SMART_LED:
+        if ((index < QRC_XLED_COUNT/3) && (data.size() == SINGLE_BYTES))
+        {
+            for (int c = 0; c < 3; ++c)
+                board.smartLeds.set(index*3+c, (((unsigned char)data[1+2*c] & 0x0F) << 8) | (unsigned char)data[2+2*c]);
+        }
+        break;
+    case CMD_GET_KEYS:
+        return request(address, command, stateData(board).mid(0, KEY_BYTES));
+    case CMD_GET_SLIDERS:
+        return request(address, command, stateData(board).mid(3, QRC_SLIDER_COUNT));
+    case CMD_GET_ENCODERS:
+        return request(address, command, stateData(board).mid(11, QRC_ENCODER_COUNT*2));
+    case CMD_GET_SENSORS:
+        return request(address, command, stateData(board).mid(19, QRC_SENSOR_COUNT));
+    case CMD_GET_STIKY_KEYS:
+        return request(address, command, stateData(board).mid(21, KEY_BYTES));
+    case CMD_GET_STATE:
+        return request(address, command, stateData(board));
+    default:
+        return request(address, CMD_UNKNOWN, QByteArray());
+    }
+    return request(address, CMD_SUCCESS, QByteArray());
+}
+
+QList<QByteArray> BusSimulator::feed(const QByteArray& bytes, int lineBaudRate)
+{
+    QMutexLocker lock(&mMutex);
+    QList<QByteArray> replies;
+    mInput.append(bytes);
+
+    forever
+    {
+        unsigned char address;
+        unsigned char command;
+        QByteArray data;
+        ost_parse_result result = parse(mInput, address, command, data);
+        if (result == PARSE_NONE)
+            break;
+        if (result != PARSE_SUCCESS)
+            continue; // платы молча выбрасывают мусор
+
+        bool broadcast = (address == 0) || (address == 15);
+        for (auto it = mBoards.begin(); it != mBoards.end(); ++it)
+        {
+            if (!broadcast && (it.key() != address))
+                continue;
+            Board& board = it.value();
+            // На чужой скорости плата слышит только мусор
+            if ((lineBaudRate > 0) && (qrc::baudRate(board.baudRate) != lineBaudRate))
+                continue;
+
+            bool silent = broadcast;
+            QByteArray reply = execute(board, it.key(), command, data, silent);
+            if (silent || reply.isEmpty())
+                continue;
+
+            if (random(100) < mDropPercent)
+                continue;
+            if (random(100) < mCorruptPercent)
+            {
+                int pos = random(reply.size());
+                reply[pos] = char(reply[pos] ^ (1 << random(8)));
+            }
+            if (random(100) < mNoisePercent)
+            {
+                QByteArray noise;
+                for (int i = 1 + random(NOISE_MAX); i > 0; --i)
+                    noise.append(char(random(0x80))); // без признака начала пакета
+                reply.prepend(noise);
+            }
+            replies.append(reply);
+        }
+    }
+    return replies;
+}
+
+/******************************************************************************
+ * SimulatorDevice
+ ******************************************************************************/
+
+SimulatorDevice::SimulatorDevice(QSharedPointer<BusSimulator> bus, QObject *parent)
+    : QIODevice(parent)
+    , mBus(bus)
+    , mTimer(this)
+{
+    mTimer.setSingleShot(true);
+    connect(&mTimer, SIGNAL(timeout()), this, SLOT(process()));
+    mClock.start();
+}
+
+SimulatorDevice::~SimulatorDevice()
+{}
+
+QSharedPointer<BusSimulator> SimulatorDevice::bus() const
+{
+    return mBus;
+}
+
+void SimulatorDevice::setBaudRate(int baudrate)
+{
+    mBaudRate = baudrate;
+}
+
+int SimulatorDevice::baudRate() const
+{
+    return mBaudRate;
+}
+
+void SimulatorDevice::setThrottle(bool enabled)
+{
+    mThrottle = enabled;
+}
+
+void SimulatorDevice::setReplyDelay(int msec)
+{
+    mReplyDelay = qMax(0, msec);
+}
+
+bool SimulatorDevice::isSequential() const
+{
+    return true;
+}
+
+qint64 SimulatorDevice::bytesAvailable() const
+{
+    return mRead.size() + QIODevice::bytesAvailable();
+}
+
+qint64 SimulatorDevice::bytesToWrite() const
+{
+    return mPending;
+}
+
+qint64 SimulatorDevice::readData(char *data, qint64 maxSize)
+{
+    qint64 size = qMin(maxSize, qint64(mRead.size()));
+    memcpy(data, mRead.constData(), size_t(size));
+    mRead.remove(0, int(size));
+    return size;
+}
+
+qint64 SimulatorDevice::writeData(const char *data, qint64 maxSize)
+{
+    qint64 now = mClock.elapsed();
+    int wire = mThrottle ? wireTime(int(maxSize), mBaudRate) : 0;
+    mTxBusy = qMax(now, mTxBusy) + wire;
+
+    Event event;
+    event.at = mTxBusy;
+    event.reply = false;
+    event.bytes = QByteArray(data, int(maxSize));
+    schedule(event);
+
+    mPending += maxSize;
+    return maxSize;
+}
+
+void SimulatorDevice::schedule(const Event& event)
+{
+    int pos = mEvents.size();
+    while ((pos > 0) && (mEvents[pos-1].at > event.at))
+        --pos;
+    mEvents.insert(pos, event);
+    mTimer.start(int(qMax(qint64(0), mEvents.first().at - mClock.elapsed())));
+}
+
+void SimulatorDevice::process()
+{
+    qint64 now = mClock.elapsed();
+    while (!mEvents.isEmpty() && (mEvents.first().at <= now))
+    {
+        Event event = mEvents.takeFirst();
+        if (event.reply)
+        {
+            mRead.append(event.bytes);
+            emit readyRead();
+            continue;
+        }
+
+        mPending -= event.bytes.size();
+        emit bytesWritten(event.bytes.size());
+
+        for (const QByteArray& reply : mBus->feed(event.bytes, mThrottle ? mBaudRate : 0))
+        {
+            int wire = mThrottle ? wireTime(reply.size(), mBaudRate) : 0;
+            mRxBusy = qMax(now + mReplyDelay, mRxBusy) + wire;
+
+            Event answer;
+            answer.at = mRxBusy;
+            answer.reply = true;
+            answer.bytes = reply;
+            schedule(answer);
+        }
+    }
+    if (!mEvents.isEmpty())
+        mTimer.start(int(qMax(qint64(0), mEvents.first().at - mClock.elapsed())));
+}
+
+/******************************************************************************
+ * SimulatorTransport
+ ******************************************************************************/
+
+SimulatorTransport::SimulatorTransport(SimulatorDevice* device)
+    : DeviceTransport(device)
+    , mSimulator(device)
+{}
+
+bool SimulatorTransport::canSetBaudRate() const
+{
+    return true;
+}
+
+bool SimulatorTransport::setBaudRate(int baudrate)
+{
+    mSimulator->setBaudRate(baudrate);
+    return true;
+}
+
+/******************************************************************************
+ * SimulatorPty
+ ******************************************************************************/
+
+#ifdef Q_OS_UNIX
+
+SimulatorPty::SimulatorPty(QSharedPointer<BusSimulator> bus, QObject *parent)
+    : QObject(parent)
+    , mDevice(bus, this)
+{
+    // Скорость настраивает тот, кто откроет терминал, её отсюда не видно:
+    // платы слышат на любой, а байты уходят без задержки на линии
+    mDevice.setThrottle(false);
+    connect(&mDevice, SIGNAL(readyRead()), this, SLOT(deviceReadable()));
+}
+
+SimulatorPty::~SimulatorPty()
+{
+    close();
+}
+
+bool SimulatorPty::open()
+{
+    close();
+
+    mMaster = posix_openpt(O_RDWR | O_NOCTTY);
+    if (mMaster < 0)
+        return false;
+    if ((grantpt(mMaster) != 0) || (unlockpt(mMaster) != 0))
+    {
+        close();
+        return false;
+    }
+    mPortName = QString::fromLocal8Bit(ptsname(mMaster));
+
+    // Сырой режим, чтобы терминал не трогал байты протокола
+    struct termios tio;
+    if (tcgetattr(mMaster, &tio) == 0)
+    {
+        cfmakeraw(&tio);
+        tcsetattr(mMaster, TCSANOW, &tio);
+    }
+    fcntl(mMaster, F_SETFL, fcntl(mMaster, F_GETFL) | O_NONBLOCK);
+
+    mDevice.open(QIODevice::ReadWrite);
+    mNotifier = new QSocketNotifier(mMaster, QSocketNotifier::Read, this);
+    connect(mNotifier, SIGNAL(activated(int)), this, SLOT(masterReadable()));
+    return true;
+}
+
+void SimulatorPty::close()
+{
+    delete mNotifier;
+    mNotifier = 0;
+    if (mMaster >= 0)
+        ::close(mMaster);
+    mMaster = -1;
+    mPortName.clear();
+    mDevice.close();
+}
+
+QString SimulatorPty::portName() const
+{
+    return mPortName;
+}
+
+SimulatorDevice& SimulatorPty::device()
+{
+    return mDevice;
+}
+
+void SimulatorPty::masterReadable()
+{
+    char buffer[256];
+    ssize_t size;
+    while ((size = ::read(mMaster, buffer, sizeof(buffer))) > 0)
+        mDevice.write(buffer, size);
+}
+
+void SimulatorPty::deviceReadable()
+{
+    QByteArray bytes = mDevice.readAll();
+    if ((mMaster >= 0) && !bytes.isEmpty())
+    {
+        ssize_t written = ::write(mMaster, bytes.constData(), size_t(bytes.size()));
+        Q_UNUSED(written)
+    }
+}
+
+#endif
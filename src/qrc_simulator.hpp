@@ -0,0 +1,182 @@
+/******************************************************************************
+ *
+ * Quest Room Control
+ *
+ * Software emulation of boards on a bus
+ *
+ * (c) Roman A. Bulygin 2016
+ *
+ ******************************************************************************/
+
+#pragma once
+
+#ifndef _QRC_SIMULATOR_HPP_
+#define _QRC_SIMULATOR_HPP_
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QIODevice>
+#include <QList>
+#include <QMap>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QTimer>
+
+#include "qrc_protocol.hpp"
+#include "qrc_transport.hpp"
+
+class QSocketNotifier;
+
+namespace qrc {
+
+// Платы на шине: разбирают поток байт так же, как настоящие (qrc::parse),
+// выполняют все команды протокола и отвечают пакетами qrc::request.
+// Состояние входов задаётся, состояние выходов читается - из любого потока.
+class BusSimulator
+{
+public:
+    BusSimulator();
+
+    void addBoard(int address);
+    void removeBoard(int address);
+    QList<int> boards() const;
+
+    // Входы
+    void setKey(int address, int key, bool down); // нажатие заодно "залипает"
+    void clearStikyKeys(int address);
+    void setSlider(int address, int slider, int value);
+    void setEncoder(int address, int encoder, int value);
+    void setSensor(int address, int sensor, int value);
+
+    // Выходы
+    unsigned char relays(int address) const;
+    QByteArray leds(int address) const;
+    QByteArray smartLeds(int address) const;
+    QByteArray text(int address) const;
+    int baudRate(int address) const; // индекс BAUDRATE_*
+
+    // Сбои в процентах на каждый ответ: потерять, испортить бит, добавить мусор перед ответом
+    void setFaults(int dropPercent, int corruptPercent, int noisePercent);
+    void setSeed(quint32 seed);
+
+    // Байты с линии на скорости lineBaudRate бод (0 - платы слышат на любой скорости).
+    // Возвращает ответы плат, каждый отдельным куском.
+    QList<QByteArray> feed(const QByteArray& bytes, int lineBaudRate);
+
+private:
+    struct Board
+    {
+        Board();
+        int baudRate;
+        unsigned char relays;
+        LedHelper leds;
+        XLedHelper smartLeds;
+        QByteArray text;
+        quint32 keys;
+        quint32 stiky;
+        unsigned char sliders[QRC_SLIDER_COUNT];
+        quint16 encoders[QRC_ENCODER_COUNT];
+        unsigned char sensors[QRC_SENSOR_COUNT];
+    };
+
+    mutable QMutex mMutex;
+    QMap<int, Board> mBoards;
+    QByteArray mInput;
+    int mDropPercent {0};
+    int mCorruptPercent {0};
+    int mNoisePercent {0};
+    quint32 mSeed {1};
+
+    int random(int range);
+    QByteArray execute(Board& board, int address, int command, const QByteArray& data, bool& silent);
+    QByteArray stateData(const Board& board) const;
+};
+
+// Порт с платами внутри. Подставляется в Device::open вместо последовательного порта.
+// Время на линии считается по скорости порта, ответ приходит с задержкой реакции платы.
+class SimulatorDevice : public QIODevice
+{
+    Q_OBJECT
+
+    struct Event
+    {
+        qint64 at;        // когда, мс
+        bool reply;       // true - пришёл ответ, false - ушёл запрос
+        QByteArray bytes;
+    };
+
+    QSharedPointer<BusSimulator> mBus;
+    QList<Event> mEvents; // по возрастанию времени
+    QTimer mTimer;
+    QElapsedTimer mClock;
+    QByteArray mRead;
+    qint64 mPending {0};   // байт ещё не ушло в линию
+    qint64 mTxBusy {0};    // до какого момента занята передача, мс
+    qint64 mRxBusy {0};    // до какого момента занят приём, мс
+    int mBaudRate {9600};
+    bool mThrottle {true};
+    int mReplyDelay {2};   // мс
+
+    void schedule(const Event& event);
+public:
+    explicit SimulatorDevice(QSharedPointer<BusSimulator> bus, QObject *parent = 0);
+    ~SimulatorDevice();
+
+    QSharedPointer<BusSimulator> bus() const;
+
+    void setBaudRate(int baudrate); // бод
+    int baudRate() const;
+    void setThrottle(bool enabled); // false - байты уходят мгновенно
+    void setReplyDelay(int msec);   // время реакции платы
+
+    bool isSequential() const override;
+    qint64 bytesAvailable() const override;
+    qint64 bytesToWrite() const override;
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override;
+    qint64 writeData(const char *data, qint64 maxSize) override;
+
+private slots:
+    void process();
+};
+
+// Симулятор как транспорт шины: в отличие от DeviceTransport переключает скорость линии
+class SimulatorTransport : public DeviceTransport
+{
+    SimulatorDevice* mSimulator;
+public:
+    explicit SimulatorTransport(SimulatorDevice* device);
+
+    bool canSetBaudRate() const override;
+    bool setBaudRate(int baudrate) override;
+};
+
+#ifdef Q_OS_UNIX
+// Платы за псевдотерминалом: portName() открывается как обычный последовательный порт.
+class SimulatorPty : public QObject
+{
+    Q_OBJECT
+
+    SimulatorDevice mDevice;
+    int mMaster {-1};
+    QString mPortName;
+    QSocketNotifier* mNotifier {0};
+public:
+    explicit SimulatorPty(QSharedPointer<BusSimulator> bus, QObject *parent = 0);
+    ~SimulatorPty();
+
+    bool open();
+    void close();
+    QString portName() const;
+    SimulatorDevice& device();
+
+private slots:
+    void masterReadable();
+    void deviceReadable();
+};
+#endif
+
+} // namespace qrc
+
+#endif // _QRC_SIMULATOR_HPP_
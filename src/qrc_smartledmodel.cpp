@@ -58,7 +58,12 @@ static inline QString groupName(const QModelIndex & index)
 QrcSmartLedModel::QrcSmartLedModel(QObject * parent)
     : QAbstractTableModel(parent)
     , leds(LEDS_TOTAL)
-{}
+    , groupsPending(0)
+    , batch(this)
+{
+    connect(&batch, SIGNAL(cellsChanged(int, int, int, int)), SLOT(cellsChanged(int, int, int, int)));
+    connect(&batch, SIGNAL(frame()), SLOT(flushLeds()));
+}
 
 QrcSmartLedModel::~QrcSmartLedModel()
 {}
@@ -168,14 +173,39 @@ QrcSmartLedModel::setData(const QModelIndex & idx, const QVariant & value, int r
     {
         bool ok;
         int intVal = qBound(0, value.toInt(&ok), 0xFFF);
-        if(ok)
+        if(ok && (leds.get(ledIdx) != intVal))
+        {
             leds.set(ledIdx, intVal);
-        emit dataChanged(index(idx.row(), idx.column()), index(idx.row(), idx.column()));
-        // Все
-        emit ledsChanged(leds.data());
-        // Отдельная группа
-        int group = ledIdx / LEDS_PER_GROUP;
-        emit ledChanged(group, leds.get(group*LEDS_PER_GROUP), leds.get(group*LEDS_PER_GROUP+1), leds.get(group*LEDS_PER_GROUP+2));
+            batch.cellChanged(idx.row(), idx.column());
+            groupsPending |= 1u << (ledIdx / LEDS_PER_GROUP);
+            batch.changed();
+        }
     }
     return true;
 }
+
+void
+QrcSmartLedModel::cellsChanged(int top, int left, int bottom, int right)
+{
+    emit dataChanged(index(top, left), index(bottom, right));
+}
+
+void
+QrcSmartLedModel::flushLeds()
+{
+    if (groupsPending == 0)
+        return;
+    quint32 groups = groupsPending;
+    groupsPending = 0;
+    // Все
+    QByteArray data = leds.data();
+    if (data != sent)
+    {
+        sent = data;
+        emit ledsChanged(sent);
+    }
+    // Отдельные группы
+    for (int group = 0; groups != 0; ++group, groups >>= 1)
+        if (groups & 1)
+            emit ledChanged(group, leds.get(group*LEDS_PER_GROUP), leds.get(group*LEDS_PER_GROUP+1), leds.get(group*LEDS_PER_GROUP+2));
+}
@@ -12,12 +12,16 @@
 
 #include <QAbstractTableModel>
 #include <QVector>
+#include "qrc_batch.hpp"
 #include "qrc_protocol.hpp"
 
 class QrcSmartLedModel : public QAbstractTableModel
 {
 Q_OBJECT
     qrc::XLedHelper leds;
+    QByteArray sent;       // последнее отправленное ledsChanged
+    quint32 groupsPending; // группы с не отправленными изменениями, бит на группу
+    qrc::ChangeBatch batch;
 public:
     QrcSmartLedModel(QObject * parent = 0);
     ~QrcSmartLedModel();
@@ -29,6 +33,21 @@ public:
     QVariant data(const QModelIndex & index, int role = Qt::DisplayRole) const;
     bool setData(const QModelIndex & idx, const QVariant & value, int role);
 
+    // Пакет изменений: между beginBatch() и endBatch() setData не шлёт сигналов,
+    // по endBatch() - один dataChanged на охватывающий прямоугольник, один ledsChanged
+    // и ledChanged на каждую изменённую группу. Пакеты могут быть вложенными.
+    void beginBatch() { batch.begin(); }
+    void endBatch() { batch.end(); }
+
+    // ledsChanged и ledChanged не чаще fps раз в секунду, последнее состояние
+    // не теряется. 0 - сразу после каждого изменения.
+    void setFrameRate(int fps) { batch.setFrameRate(fps); }
+    int getFrameRate() const { return batch.frameRate(); }
+
+private slots:
+    void cellsChanged(int top, int left, int bottom, int right);
+    void flushLeds();
+
 signals:
     void ledsChanged(const QByteArray& leds);
     void ledChanged(int group, int r, int g, int b);
@@ -0,0 +1,157 @@
+/******************************************************************************
+ *
+ * Quest Room Control
+ *
+ * Board inputs decoded from CMD_GET_STATE
+ *
+ * (c) Roman A. Bulygin 2016
+ *
+ ******************************************************************************/
+#include "qrc_state.hpp"
+
+#include <string.h>
+
+namespace qrc {
+
+// Раскладка данных CMD_GET_STATE
+enum {
+    KEYS_OFFSET = 0,
+    KEYS_SIZE = 3,
+    SLIDERS_OFFSET = 3,
+    ENCODERS_OFFSET = 11,
+    SENSORS_OFFSET = 19,
+    STIKY_OFFSET = 21,
+};
+
+static inline quint32 getBits(const unsigned char* data, int size, int offset)
+{
+    quint32 bits = 0;
+    for (int i = 0; (i < KEYS_SIZE) && (offset + i < size); ++i)
+        bits |= quint32(data[offset + i]) << (8*i);
+    return bits & ((1u << QRC_KEY_COUNT) - 1);
+}
+
+bool decodeState(const unsigned char* data, int size, int address, qint64 timestamp, StateSnapshot& state)
+{
+    memset(&state, 0, sizeof(state));
+    state.timestamp = timestamp;
+    state.address = address;
+    size = qMax(0, size);
+
+    state.keys = getBits(data, size, KEYS_OFFSET);
+    state.stiky = getBits(data, size, STIKY_OFFSET);
+    for (int i = 0; (i < QRC_SLIDER_COUNT) && (SLIDERS_OFFSET + i < size); ++i)
+        state.sliders[i] = data[SLIDERS_OFFSET + i];
+    // энкодеры в LE
+    for (int i = 0; (i < QRC_ENCODER_COUNT) && (ENCODERS_OFFSET + 2*i + 1 < size); ++i)
+        state.encoders[i] = quint16(data[ENCODERS_OFFSET + 2*i] | (data[ENCODERS_OFFSET + 2*i + 1] << 8));
+    for (int i = 0; (i < QRC_SENSOR_COUNT) && (SENSORS_OFFSET + i < size); ++i)
+        state.sensors[i] = data[SENSORS_OFFSET + i];
+
+    return size >= STATE_SIZE;
+}
+
+InputTracker::InputTracker()
+{}
+
+void InputTracker::setThresholds(int slider, int encoder, int sensor)
+{
+    mSliderThreshold = qMax(1, slider);
+    mEncoderThreshold = qMax(1, encoder);
+    mSensorThreshold = qMax(1, sensor);
+}
+
+static inline InputEvent* addEvent(InputEvent* event, const StateSnapshot& state, InputEvent::Kind kind,
+                                   int index, int value, int delta = 0)
+{
+    event->timestamp = state.timestamp;
+    event->address = state.address;
+    event->kind = kind;
+    event->index = index;
+    event->value = value;
+    event->delta = delta;
+    return event + 1;
+}
+
+int InputTracker::update(const StateSnapshot& state, InputEvent* events)
+{
+    auto it = mLast.find(state.address);
+    if (it == mLast.end())
+    {
+        mLast.insert(state.address, state);
+        return 0;
+    }
+    StateSnapshot& last = it.value();
+    InputEvent* out = events;
+
+    // Кнопки - фронты по изменившимся битам
+    for (quint32 changed = state.keys ^ last.keys; changed != 0; changed &= changed - 1)
+    {
+        int key = 0;
+        while (((changed >> key) & 1) == 0)
+            ++key;
+        bool down = state.key(key);
+        out = addEvent(out, state, down ? InputEvent::KEY_DOWN : InputEvent::KEY_UP, key, down);
+    }
+    for (quint32 changed = state.stiky ^ last.stiky; changed != 0; changed &= changed - 1)
+    {
+        int key = 0;
+        while (((changed >> key) & 1) == 0)
+            ++key;
+        out = addEvent(out, state, InputEvent::STIKY_KEY, key, state.stikyKey(key));
+    }
+    last.keys = state.keys;
+    last.stiky = state.stiky;
+
+    for (int i = 0; i < QRC_SLIDER_COUNT; ++i)
+    {
+        if (qAbs(int(state.sliders[i]) - int(last.sliders[i])) >= mSliderThreshold)
+        {
+            out = addEvent(out, state, InputEvent::SLIDER, i, state.sliders[i]);
+            last.sliders[i] = state.sliders[i];
+        }
+    }
+    for (int i = 0; i < QRC_ENCODER_COUNT; ++i)
+    {
+        // Счётчик 16 бит и переполняется: разница со знаком по модулю 2^16
+        int delta = qint16(quint16(state.encoders[i] - last.encoders[i]));
+        if (qAbs(delta) >= mEncoderThreshold)
+        {
+            out = addEvent(out, state, InputEvent::ENCODER, i, state.encoders[i], delta);
+            last.encoders[i] = state.encoders[i];
+        }
+    }
+    for (int i = 0; i < QRC_SENSOR_COUNT; ++i)
+    {
+        if (qAbs(int(state.sensors[i]) - int(last.sensors[i])) >= mSensorThreshold)
+        {
+            out = addEvent(out, state, InputEvent::SENSOR, i, state.sensors[i]);
+            last.sensors[i] = state.sensors[i];
+        }
+    }
+    last.timestamp = state.timestamp;
+    return int(out - events);
+}
+
+bool InputTracker::contains(int address) const
+{
+    return mLast.contains(address);
+}
+
+void InputTracker::forget(int address)
+{
+    mLast.remove(address);
+}
+
+void InputTracker::clear()
+{
+    mLast.clear();
+}
+
+void registerStateMetaType()
+{
+    static const int id = qRegisterMetaType<StateSnapshot>("qrc::StateSnapshot");
+    Q_UNUSED(id)
+}
+
+} // namespace qrc
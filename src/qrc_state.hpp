@@ -0,0 +1,109 @@
+/******************************************************************************
+ *
+ * Quest Room Control
+ *
+ * Board inputs decoded from CMD_GET_STATE
+ *
+ * (c) Roman A. Bulygin 2016
+ *
+ ******************************************************************************/
+
+#pragma once
+
+#ifndef _QRC_STATE_HPP_
+#define _QRC_STATE_HPP_
+
+#include <QHash>
+#include <QMetaType>
+#include <QtGlobal>
+
+#include "qrc_protocol.hpp"
+
+namespace qrc {
+
+// Все входы платы одним пакетом. Простая структура фиксированного размера:
+// в очередной сигнал копируется целиком, без выделения памяти.
+struct StateSnapshot
+{
+    qint64 timestamp;                      // мс от эпохи, когда пришёл ответ
+    int address;                           // адрес узла (см. nodeAddress)
+    quint32 keys;                          // кнопки, бит на кнопку
+    quint32 stiky;                         // залипшие кнопки, бит на кнопку
+    quint8 sliders[QRC_SLIDER_COUNT];      // АЦП
+    quint16 encoders[QRC_ENCODER_COUNT];   // счётчики энкодеров
+    quint8 sensors[QRC_SENSOR_COUNT];      // попугаи сенсорных кнопок
+
+    bool key(int index) const { return (keys >> index) & 1; }
+    bool stikyKey(int index) const { return (stiky >> index) & 1; }
+};
+
+enum {
+    STATE_SIZE = 24, // байт данных в ответе на CMD_GET_STATE
+};
+
+// Разбор данных ответа на CMD_GET_STATE. Недостающие байты считаются нулями,
+// false - данных меньше STATE_SIZE: такой снимок ни в InputTracker, ни в правила.
+bool decodeState(const unsigned char* data, int size, int address, qint64 timestamp, StateSnapshot& state);
+
+// Изменение входа платы
+struct InputEvent
+{
+    enum Kind
+    {
+        KEY_DOWN,
+        KEY_UP,
+        STIKY_KEY, // залипание кнопки появилось (value 1) или сброшено (value 0)
+        SLIDER,    // АЦП ушёл от прошлого значения не меньше чем на порог
+        ENCODER,   // энкодер повернулся не меньше чем на порог, delta со знаком
+        SENSOR,    // сенсор ушёл от прошлого значения не меньше чем на порог
+    };
+
+    qint64 timestamp;
+    int address;
+    Kind kind;
+    int index; // номер кнопки, слайдера, энкодера или сенсора
+    int value;
+    int delta; // для ENCODER - на сколько повернулся с прошлого события
+};
+
+// Выделение изменений из снимков состояния: хранит прошлое по каждому адресу
+// и отдаёт только фронты и заметные сдвиги. Для аналоговых входов значение,
+// от которого меряется порог, обновляется только вместе с событием,
+// поэтому медленный дрейф тоже рано или поздно даст событие.
+class InputTracker
+{
+public:
+    enum {
+        // Больше событий из одного снимка не бывает
+        MAX_EVENTS = QRC_KEY_COUNT*2 + QRC_SLIDER_COUNT + QRC_ENCODER_COUNT + QRC_SENSOR_COUNT,
+    };
+
+    InputTracker();
+
+    // Пороги срабатывания, не меньше 1
+    void setThresholds(int slider, int encoder, int sensor);
+
+    // Сравнить снимок с прошлым по его адресу и записать события в events
+    // (не меньше MAX_EVENTS). Возвращает число событий. Первый снимок адреса
+    // только запоминается.
+    int update(const StateSnapshot& state, InputEvent* events);
+
+    bool contains(int address) const;
+    void forget(int address); // следующий снимок адреса снова станет первым
+    void clear();
+
+private:
+    QHash<int, StateSnapshot> mLast; // значения, от которых считаются изменения
+    int mSliderThreshold {2}; // дребезг АЦП
+    int mEncoderThreshold {1};
+    int mSensorThreshold {1};
+};
+
+// Регистрация для очередей сигналов между потоками, можно звать сколько угодно раз
+void registerStateMetaType();
+
+} // namespace qrc
+
+Q_DECLARE_METATYPE(qrc::StateSnapshot)
+
+#endif // _QRC_STATE_HPP_
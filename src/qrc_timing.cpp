@@ -0,0 +1,71 @@
+/******************************************************************************
+ *
+ * Quest Room Control
+ *
+ * Bus timing: wire time and adaptive reply timeouts
+ *
+ * (c) Roman A. Bulygin 2016
+ *
+ ******************************************************************************/
+#include "qrc_timing.hpp"
+
+#include <QtGlobal>
+
+using namespace qrc;
+
+enum {
+    BITS_PER_BYTE = 10, // старт + 8 бит + стоп
+    DEFAULT_TURNAROUND = 100, // ms, пока про плату ничего не известно
+    LATENCY_MARGIN = 10,  // ms, задержки USB-переходника и планировщика ОС
+    MIN_TURNAROUND = 10,  // ms
+    MAX_TURNAROUND = 500, // ms
+    MAX_BACKOFF = 6,      // удвоений: 10 ms << 6 уже больше MAX_TURNAROUND
+};
+
+int qrc::wireTime(int bytes, int baudrate)
+{
+    if (baudrate <= 0)
+        return 0;
+    return int((qint64(bytes) * BITS_PER_BYTE * 1000 + baudrate - 1) / baudrate);
+}
+
+void RttEstimator::sample(int turnaround)
+{
+    float value = qMax(0, turnaround);
+    if (mSamples == 0)
+    {
+        mSrtt = value;
+        mRttVar = value / 2;
+    }
+    else
+    {
+        float delta = value - mSrtt;
+        mSrtt += delta / 8;
+        mRttVar += (qAbs(delta) - mRttVar) / 4;
+    }
+    ++mSamples;
+    mBackoff = 0;
+}
+
+void RttEstimator::timedOut()
+{
+    ++mTimeouts;
+    mBackoff = qMin(mBackoff + 1, int(MAX_BACKOFF));
+}
+
+void RttEstimator::reset()
+{
+    mSrtt = 0;
+    mRttVar = 0;
+    mSamples = 0;
+    mTimeouts = 0;
+    mBackoff = 0;
+}
+
+int RttEstimator::timeout(int wire) const
+{
+    int turnaround = DEFAULT_TURNAROUND;
+    if (mSamples > 0)
+        turnaround = qBound(int(MIN_TURNAROUND), int(mSrtt + 4 * mRttVar) + LATENCY_MARGIN, int(MAX_TURNAROUND));
+    return wire + qMin(turnaround << mBackoff, qMax(turnaround, int(MAX_TURNAROUND)));
+}
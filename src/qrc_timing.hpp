@@ -0,0 +1,52 @@
+/******************************************************************************
+ *
+ * Quest Room Control
+ *
+ * Bus timing: wire time and adaptive reply timeouts
+ *
+ * (c) Roman A. Bulygin 2016
+ *
+ ******************************************************************************/
+
+#pragma once
+
+#ifndef _QRC_TIMING_HPP_
+#define _QRC_TIMING_HPP_
+
+namespace qrc {
+
+// Время передачи bytes байт на скорости baudrate бод (8N1, 10 бит на байт), мс с округлением вверх
+int wireTime(int bytes, int baudrate);
+
+// Оценка времени реакции платы по адресу.
+// Меряется время сверх передачи запроса и ответа по линии, сглаживается
+// экспоненциальным средним с разбросом (как RTO в TCP). Пока замеров нет,
+// таймаут берётся с запасом. Каждый таймаут подряд удваивает ожидание (до предела),
+// первый же замер возвращает его к оценке - так плата, ставшая медленнее, не
+// теряет ответ на каждом повторе.
+class RttEstimator
+{
+    float mSrtt {0};   // сглаженное время реакции, мс
+    float mRttVar {0}; // сглаженный разброс, мс
+    int mSamples {0};
+    int mTimeouts {0};
+    int mBackoff {0};  // таймаутов подряд с последнего замера
+public:
+    // Замер: полное время транзакции минус время на линии, мс
+    void sample(int turnaround);
+    void timedOut();
+    void reset();
+
+    // Таймаут транзакции, у которой на линии wire мс
+    int timeout(int wire) const;
+
+    int srtt() const { return int(mSrtt); }
+    int rttVar() const { return int(mRttVar); }
+    int samples() const { return mSamples; }
+    int timeouts() const { return mTimeouts; }
+    int backoff() const { return mBackoff; }
+};
+
+} // namespace qrc
+
+#endif // _QRC_TIMING_HPP_
@@ -0,0 +1,228 @@
+/******************************************************************************
+ *
+ * Quest Room Control
+ *
+ * Byte transports for a bus: serial port, TCP bridge, local socket
+ *
+ * (c) Roman A. Bulygin 2016
+ *
+ ******************************************************************************/
+#include "qrc_transport.hpp"
+
+#include <QLocalSocket>
+#include <QObject>
+#include <QSerialPort>
+#include <QTcpSocket>
+#include <QThread>
+#include <QUrl>
+
+using namespace qrc;
+
+enum {
+    CONNECT_TIMEOUT = 3000, // ms
+};
+
+Transport::~Transport()
+{}
+
+bool Transport::canSetBaudRate() const
+{
+    return false;
+}
+
+bool Transport::setBaudRate(int baudrate)
+{
+    Q_UNUSED(baudrate)
+    return false;
+}
+
+void Transport::close()
+{
+    if (!mDevice.isNull())
+        mDevice.take()->deleteLater();
+}
+
+void Transport::flush()
+{}
+
+void Transport::moveToThread(QThread* thread)
+{
+    Q_UNUSED(thread)
+}
+
+QIODevice* Transport::device() const
+{
+    return mDevice.data();
+}
+
+QString Transport::errorString() const
+{
+    return mError;
+}
+
+SerialTransport::SerialTransport(const QSerialPortInfo& info)
+    : mInfo(info)
+{}
+
+QString SerialTransport::name() const
+{
+    return mInfo.portName();
+}
+
+bool SerialTransport::open()
+{
+    if (mInfo.isNull())
+    {
+        mError = QObject::tr("Нет данных для открытия порта");
+        return false;
+    }
+    if (mInfo.isBusy())
+    {
+        mError = QObject::tr("Порт %1 занят").arg(mInfo.portName());
+        return false;
+    }
+
+    QSerialPort* serial = new QSerialPort(mInfo);
+    mDevice.reset(serial);
+
+    // После включения платы работают на 9600, быстрее - только через setBaudRate
+    serial->setBaudRate(QSerialPort::Baud9600);
+    serial->setDataBits(QSerialPort::Data8);
+    serial->setParity(QSerialPort::NoParity);
+    serial->setStopBits(QSerialPort::OneStop);
+    serial->setFlowControl(QSerialPort::NoFlowControl);
+
+    if (!serial->open(QIODevice::ReadWrite))
+    {
+        mDevice.reset();
+        mError = QObject::tr("Не могу открыть порт %1").arg(mInfo.portName());
+        return false;
+    }
+    return true;
+}
+
+bool SerialTransport::canSetBaudRate() const
+{
+    return true;
+}
+
+bool SerialTransport::setBaudRate(int baudrate)
+{
+    QSerialPort* serial = static_cast<QSerialPort*>(mDevice.data());
+    return (serial != 0) && serial->setBaudRate(baudrate);
+}
+
+void SerialTransport::flush()
+{
+    QSerialPort* serial = static_cast<QSerialPort*>(mDevice.data());
+    if (serial != 0)
+        serial->flush();
+}
+
+TcpTransport::TcpTransport(const QString& host, quint16 port)
+    : mHost(host)
+    , mPort(port)
+{}
+
+QString TcpTransport::name() const
+{
+    return QString("tcp://%1:%2").arg(mHost).arg(mPort);
+}
+
+bool TcpTransport::open()
+{
+    QTcpSocket* socket = new QTcpSocket;
+    mDevice.reset(socket);
+
+    // Один раз при открытии шины можно и подождать, дальше обмен не блокируется
+    socket->connectToHost(mHost, mPort);
+    if (!socket->waitForConnected(CONNECT_TIMEOUT))
+    {
+        mError = QObject::tr("Нет связи с %1: %2").arg(name()).arg(socket->errorString());
+        mDevice.reset();
+        return false;
+    }
+    // Пакеты короткие и ждут ответа: Nagle только добавил бы задержку
+    socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+    return true;
+}
+
+LocalTransport::LocalTransport(const QString& server)
+    : mServer(server)
+{}
+
+QString LocalTransport::name() const
+{
+    return QString("local:%1").arg(mServer);
+}
+
+bool LocalTransport::open()
+{
+    QLocalSocket* socket = new QLocalSocket;
+    mDevice.reset(socket);
+
+    socket->connectToServer(mServer);
+    if (!socket->waitForConnected(CONNECT_TIMEOUT))
+    {
+        mError = QObject::tr("Нет связи с %1: %2").arg(name()).arg(socket->errorString());
+        mDevice.reset();
+        return false;
+    }
+    return true;
+}
+
+DeviceTransport::DeviceTransport(QIODevice* device)
+{
+    mDevice.reset(device);
+}
+
+QString DeviceTransport::name() const
+{
+    return mDevice.isNull() ? QString() : QString(mDevice->metaObject()->className());
+}
+
+bool DeviceTransport::open()
+{
+    if (mDevice.isNull())
+    {
+        mError = QObject::tr("Нет устройства");
+        return false;
+    }
+    if (!mDevice->isOpen() && !mDevice->open(QIODevice::ReadWrite))
+    {
+        mError = QObject::tr("Не могу открыть %1").arg(name());
+        return false;
+    }
+    return true;
+}
+
+void DeviceTransport::moveToThread(QThread* thread)
+{
+    if (!mDevice.isNull())
+    {
+        mDevice->setParent(0);
+        mDevice->moveToThread(thread);
+    }
+}
+
+Transport* qrc::createTransport(const QString& endpoint)
+{
+    if (endpoint.startsWith("tcp://"))
+    {
+        QUrl url(endpoint);
+        if (url.host().isEmpty() || (url.port() <= 0))
+            return 0;
+        return new TcpTransport(url.host(), quint16(url.port()));
+    }
+    if (endpoint.startsWith("local:"))
+    {
+        QString server = endpoint.mid(6);
+        return server.isEmpty() ? 0 : new LocalTransport(server);
+    }
+    for (const auto& info : QSerialPortInfo::availablePorts())
+    {
+        if ((info.portName() == endpoint) || (info.systemLocation() == endpoint))
+            return new SerialTransport(info);
+    }
+    return 0;
+}
@@ -0,0 +1,104 @@
+/******************************************************************************
+ *
+ * Quest Room Control
+ *
+ * Byte transports for a bus: serial port, TCP bridge, local socket
+ *
+ * (c) Roman A. Bulygin 2016
+ *
+ ******************************************************************************/
+
+#pragma once
+
+#ifndef _QRC_TRANSPORT_HPP_
+#define _QRC_TRANSPORT_HPP_
+
+#include <QIODevice>
+#include <QScopedPointer>
+#include <QSerialPortInfo>
+#include <QString>
+
+class QThread;
+
+namespace qrc {
+
+// Канал байтов до плат шины. Кадры, планировщик и таймауты - выше, в SerialWorker,
+// транспорт только открывает устройство и, если умеет, меняет скорость линии.
+// Устройство создаётся в open(), то есть в потоке обмена.
+class Transport
+{
+protected:
+    QScopedPointer<QIODevice> mDevice;
+    QString mError;
+public:
+    virtual ~Transport();
+
+    virtual QString name() const = 0;
+    virtual bool open() = 0;
+    // Закрыть устройство. Можно и из его собственного сигнала: удаляется из цикла событий.
+    void close();
+    // Может ли транспорт сам переключить скорость линии (у моста скорость задана в его настройках)
+    virtual bool canSetBaudRate() const;
+    virtual bool setBaudRate(int baudrate); // бод
+    // Отдать системе всё, что ещё лежит в буфере устройства
+    virtual void flush();
+    // Перенести уже созданное устройство в поток обмена
+    virtual void moveToThread(QThread* thread);
+
+    QIODevice* device() const;
+    QString errorString() const;
+};
+
+class SerialTransport : public Transport
+{
+    QSerialPortInfo mInfo;
+public:
+    explicit SerialTransport(const QSerialPortInfo& info);
+
+    QString name() const override;
+    bool open() override;
+    bool canSetBaudRate() const override;
+    bool setBaudRate(int baudrate) override;
+    void flush() override;
+};
+
+// Сырой TCP: мосты serial-Ethernet в режиме TCP-сервера или подставные шины на localhost
+class TcpTransport : public Transport
+{
+    QString mHost;
+    quint16 mPort;
+public:
+    TcpTransport(const QString& host, quint16 port);
+
+    QString name() const override;
+    bool open() override;
+};
+
+class LocalTransport : public Transport
+{
+    QString mServer;
+public:
+    explicit LocalTransport(const QString& server);
+
+    QString name() const override;
+    bool open() override;
+};
+
+// Готовое устройство, транспорт становится его владельцем
+class DeviceTransport : public Transport
+{
+public:
+    explicit DeviceTransport(QIODevice* device);
+
+    QString name() const override;
+    bool open() override;
+    void moveToThread(QThread* thread) override;
+};
+
+// Транспорт по строке: "tcp://host:port", "local:name" или имя последовательного порта.
+// 0 - строку не разобрать или порта нет.
+Transport* createTransport(const QString& endpoint);
+
+} // namespace qrc
+
+#endif // _QRC_TRANSPORT_HPP_